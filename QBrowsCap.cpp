@@ -1,4 +1,5 @@
 #include "QBrowsCap.h"
+#include <stdio.h>
 
 QBrowsCap::QBrowsCap() {
     this->init();
@@ -15,15 +16,31 @@ QBrowsCap::QBrowsCap(const QString & csvFile, const QString & indexFile) {
     this->setIndexFile(indexFile);
 }
 
+QBrowsCap::~QBrowsCap() {
+    this->lookupPool.waitForDone();
+    this->shadowPool.waitForDone();
+    delete this->sharedCache;
+}
+
 void QBrowsCap::setCsvFile(const QString & csvFile) {
     this->csvFile = csvFile;
 }
 
 void QBrowsCap::setIndexFile(const QString &indexFile) {
     this->indexFile = indexFile;
+
+    QMutexLocker locker(&this->engineMutex);
+    this->engine.clear();
 }
 
 void QBrowsCap::init() {
+    this->sharedCache = NULL;
+    this->sharedCacheSlots = QBROWSCAP_SHARED_CACHE_DEFAULT_SLOTS;
+    this->profiling = false;
+    this->shadowMatcher = NULL;
+    this->shadowSampleInterval = 1;
+    this->shadowPending = 0;
+    this->shadowPool.setMaxThreadCount(1);
     connect(&this->manager, SIGNAL(finished(QNetworkReply*)), SLOT(downloadFinished(QNetworkReply*)));
 }
 
@@ -92,7 +109,9 @@ int QBrowsCap::getCsvVersion() const {
 
 /**
  * Get the latest version of the browscap.csv file from the internet. But,
- * only do this at most once per day.
+ * only do this at most once per day. The time and result of the last check
+ * are stored in the index; like getIndexMetadata(), this supports indexes
+ * built before schema version 3, which are outdated until the check is done.
  *
  * @return
  *   The version number, or -1 in case of error or previous check in the
@@ -105,13 +124,16 @@ int QBrowsCap::getLatestVersion() {
     // latest version from the last version check.
     QFileInfo info(this->indexFile);
     if (info.size() > 1) {
-        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "last-version-check-read");
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", this->connectionName("last-version-check-read"));
         db.setDatabaseName(this->indexFile);
         if (db.open()) {
             QSqlQuery query(db);
+            const QString select = db.tables().contains("metadata")
+                                   ? "SELECT value FROM metadata WHERE name = ?;"
+                                   : "SELECT browser_version FROM browscap WHERE pattern = ?;";
 
             // Get the last version check time stamp.
-            query.prepare("SELECT browser_version FROM browscap WHERE pattern = ?;");
+            query.prepare(select);
             query.addBindValue(QBROWSCAP_INDEX_DB_LAST_VERSION_CHECK_PATTERN);
             if (query.exec()) {
                 if (query.next())
@@ -123,7 +145,7 @@ int QBrowsCap::getLatestVersion() {
                 qCritical("Could not query '%s' for the last version check timestamp.", qPrintable(this->indexFile));
 
             // Get the latest version (as found by the last version check).
-            query.prepare("SELECT browser_version FROM browscap WHERE pattern = ?;");
+            query.prepare(select);
             query.addBindValue(QBROWSCAP_INDEX_DB_LAST_VERSION_PATTERN);
             if (query.exec()) {
                 if (query.next())
@@ -136,7 +158,7 @@ int QBrowsCap::getLatestVersion() {
 
         }
     }
-    QSqlDatabase::removeDatabase("last-version-check-read");
+    QSqlDatabase::removeDatabase(this->connectionName("last-version-check-read"));
 
     // Decide whether to request the latest version or not.
     if (lastUpdateTimestamp > QDateTime::currentMSecsSinceEpoch() / 1000 - QBROWSCAP_MIN_UPDATE_INTERVAL) {
@@ -159,18 +181,22 @@ int QBrowsCap::getLatestVersion() {
         // Store the current time as the latest update check time.
         QFileInfo info(this->indexFile);
         if (info.size() > 1) {
-            QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "last-version-check-update");
+            QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", this->connectionName("last-version-check-update"));
             db.setDatabaseName(this->indexFile);
             if (db.open()) {
                 QSqlQuery query(db);
 
-                query.prepare("DELETE FROM browscap WHERE pattern = ?;");
-                query.addBindValue(QBROWSCAP_INDEX_DB_LAST_VERSION_CHECK_PATTERN);
-                query.exec();
-                query.addBindValue(QBROWSCAP_INDEX_DB_LAST_VERSION_PATTERN);
-                query.exec();
+                if (db.tables().contains("metadata"))
+                    query.prepare("INSERT OR REPLACE INTO metadata (name, value) VALUES(?, ?);");
+                else {
+                    query.prepare("DELETE FROM browscap WHERE pattern = ?;");
+                    query.addBindValue(QBROWSCAP_INDEX_DB_LAST_VERSION_CHECK_PATTERN);
+                    query.exec();
+                    query.addBindValue(QBROWSCAP_INDEX_DB_LAST_VERSION_PATTERN);
+                    query.exec();
 
-                query.prepare("INSERT INTO browscap (pattern, browser_version) VALUES(?, ?);");
+                    query.prepare("INSERT INTO browscap (pattern, browser_version) VALUES(?, ?);");
+                }
                 query.addBindValue(QBROWSCAP_INDEX_DB_LAST_VERSION_CHECK_PATTERN);
                 query.addBindValue(QDateTime::currentMSecsSinceEpoch() / 1000);
                 if (!query.exec()) {
@@ -183,7 +209,7 @@ int QBrowsCap::getLatestVersion() {
                 }
             }
         }
-        QSqlDatabase::removeDatabase("last-version-check-update");
+        QSqlDatabase::removeDatabase(this->connectionName("last-version-check-update"));
     }
 
     return this->latestVersion;
@@ -196,59 +222,154 @@ int QBrowsCap::getLatestVersion() {
  *   The version number, or -1 in case of error.
  */
 int QBrowsCap::getIndexVersion() const {
-    int indexVersion = -1;
+    return this->getIndexMetadata(QBROWSCAP_INDEX_DB_VERSION_PATTERN);
+}
+
+/**
+ * Get the version of the schema of the index.
+ *
+ * @return
+ *   The schema version, 0 for indexes built before the schema was versioned,
+ *   or -1 in case of error.
+ */
+int QBrowsCap::getIndexSchemaVersion() const {
+    return this->getIndexMetadata(QBROWSCAP_INDEX_DB_SCHEMA_VERSION_PATTERN);
+}
+
+/**
+ * Get the ID of the build of the index. It changes every time the index is
+ * built, so it identifies the record IDs in the index.
+ *
+ * @return
+ *   The build ID, 0 for indexes built before build IDs were introduced, or
+ *   -1 in case of error.
+ */
+int QBrowsCap::getIndexBuildId() const {
+    return this->getIndexMetadata(QBROWSCAP_INDEX_DB_BUILD_ID_PATTERN);
+}
+
+/**
+ * Compare the browscap.csv version with the index version. If they match,
+ * and the index uses the current schema, the index is up-to-date.
+ */
+bool QBrowsCap::indexIsUpToDate() const {
+    if (!QFile(this->indexFile).exists()) {
+        return false;
+    }
+
+    return this->getCsvVersion() == this->getIndexVersion()
+           && this->getIndexSchemaVersion() == QBROWSCAP_INDEX_DB_SCHEMA_VERSION;
+}
+
+/**
+ * Connections to the index that are used by a single method get a name
+ * that is unique to this instance and the current thread, so they can't
+ * collide with those of other instances or threads.
+ */
+QString QBrowsCap::connectionName(const QString & purpose) const {
+    return QBrowsCapEngine::threadConnectionName(QString("%1-%2").arg(purpose).arg((quintptr) this));
+}
+
+/**
+ * Get the engine (the loaded index and its cache) for the index file,
+ * attaching to it on first use, and again after the index has been rebuilt.
+ */
+QSharedPointer<QBrowsCapEngine> QBrowsCap::getEngine() {
+    QMutexLocker locker(&this->engineMutex);
+    if (this->engine.isNull() || this->engine->isRetired())
+        this->engine = QBrowsCapEngineRegistry::acquire(this->indexFile, this->getIndexVersion());
+    return this->engine;
+}
+
+/**
+ * (Re)attach to the engine for the current version of the index file.
+ */
+void QBrowsCap::attachEngine() {
+    QMutexLocker locker(&this->engineMutex);
+    this->engine = QBrowsCapEngineRegistry::acquire(this->indexFile, this->getIndexVersion());
+}
+
+/**
+ * The index file has been rebuilt: make all instances that use it attach to
+ * a new engine. Lookups that are in progress finish with the old one.
+ */
+void QBrowsCap::retireEngine() {
+    QMutexLocker locker(&this->engineMutex);
+    this->engine.clear();
+    QBrowsCapEngineRegistry::retire(this->indexFile);
+}
+
+/**
+ * Whether lookups with the given engine use the shared cache. Its record IDs
+ * refer to the records of one build of the index. When the index has been
+ * rebuilt, the shared cache is switched to the engine's build once that is
+ * the newest one any process uses it for; until then, the engine's cache is
+ * used instead.
+ */
+bool QBrowsCap::usesSharedCache(const QBrowsCapEngine * engine) {
+    if (this->sharedCache == NULL)
+        return false;
+
+    const int buildId = engine->getBuildId();
+    const int sharedBuildId = this->sharedCache->getSharedBuildId();
+    if (buildId == sharedBuildId && buildId == this->sharedCache->getBuildId())
+        return true;
+    else if (buildId < sharedBuildId)
+        return false; // This engine will be retired.
+    else
+        return this->sharedCache->rebind(buildId);
+}
+
+/**
+ * Get a metadata value from the index. Indexes built before schema version 3
+ * stored metadata in the browser_version column of a row with a special
+ * pattern instead of in the metadata table; their metadata can still be read,
+ * so they can be detected as outdated.
+ *
+ * @return
+ *   The value, or -1 in case of error.
+ */
+int QBrowsCap::getIndexMetadata(const QString & pattern) const {
+    int value = -1;
 
     QFileInfo info(this->indexFile);
     if (info.size() > 1) {
         {
-            QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "version-check");
+            QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", this->connectionName("version-check"));
             db.setDatabaseName(this->indexFile);
             if (db.open()) {
                 QSqlQuery query(db);
-                query.prepare("SELECT browser_version FROM browscap WHERE pattern = ?;");
-                query.addBindValue(QBROWSCAP_INDEX_DB_VERSION_PATTERN);
+                if (db.tables().contains("metadata"))
+                    query.prepare("SELECT value FROM metadata WHERE name = ?;");
+                else
+                    query.prepare("SELECT browser_version FROM browscap WHERE pattern = ?;");
+                query.addBindValue(pattern);
                 if (query.exec()) {
                     query.next();
-                    indexVersion = query.value(0).toInt();
+                    value = query.value(0).toInt();
                 }
                 else
-                    qCritical("Could not query '%s' for the version number.", qPrintable(this->indexFile));
+                    qCritical("Could not query '%s' for %s.", qPrintable(this->indexFile), qPrintable(pattern));
             }
         }
-        QSqlDatabase::removeDatabase("version-check");
+        QSqlDatabase::removeDatabase(this->connectionName("version-check"));
     }
 
-    return indexVersion;
+    return value;
 }
 
 /**
- * Compare the browscap.csv version with the index version. If they match,
- * the index is up-to-date.
+ * Move a file over another one. Connections that have the old file open can
+ * keep using it.
  */
-bool QBrowsCap::indexIsUpToDate() const {
-    if (!QFile(this->indexFile).exists()) {
-        return false;
-    }
-
-    return this->getCsvVersion() == this->getIndexVersion();
-}
-
-/**
- * Open a connection to the index DB, if it doesn't exist yet.
- */
-bool QBrowsCap::connectIndexDB() {
-    // Ensure we only maintain one "index" DB connection.
-    if (QSqlDatabase::connectionNames().contains("index"))
+static bool replaceFile(const QString & source, const QString & target) {
+    // rename() replaces the target atomically on POSIX systems...
+    if (::rename(QFile::encodeName(source).constData(), QFile::encodeName(target).constData()) == 0)
         return true;
 
-    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "index");
-    db.setDatabaseName(this->indexFile);
-    if (!db.open()) {
-        qCritical("Could not open the database: %s.", qPrintable(db.lastError().text()));
-        return false;
-    }
-    else
-        return true;
+    // ... but fails on Windows if the target exists.
+    QFile::remove(target);
+    return QFile::rename(source, target);
 }
 
 /**
@@ -262,45 +383,63 @@ bool QBrowsCap::buildIndex(bool force, bool ignoreCrawlers, bool ignoreFeedReade
         return false;
     }
 
-    // If the index is up-to-date and we're not rebuilding the index with
-    // force, then we don't have to do anything.
-    if (!force && this->indexIsUpToDate()) {
-        this->connectIndexDB();
+    // If the index is up-to-date, its hot tier was built with the latest
+    // profile and we're not rebuilding the index with force, then we don't
+    // have to do anything.
+    if (!force && this->indexIsUpToDate() && !this->hotTierIsOutdated()) {
+        this->attachEngine();
         return true;
     }
 
-    // Delete existing index, possibly with force, or bail out.
-    if (QFile::exists(this->indexFile)) {
-        if (!force && this->indexIsUpToDate()) {
-            qWarning("Index already exists.");
-            return false;
-        }
-        else if (!QFile::remove(this->indexFile)) {
-            qCritical("Existing index could not be deleted");
-            return false;
-        }
+    // Every build gets a new ID: rebuilding with other options changes the
+    // record IDs, also when the version stays the same. Build IDs increase,
+    // so that processes can tell which of two builds is the newer one.
+    const int buildId = qMax((int) QDateTime::currentDateTime().toTime_t(), this->getIndexBuildId() + 1);
+
+    // Build the new index next to the existing one, which lookups can keep
+    // using until the new one replaces it.
+    QTemporaryFile buildFile(this->indexFile + ".build.XXXXXX");
+    if (!buildFile.open()) {
+        qCritical("Could not create a file for the new index: %s.", qPrintable(buildFile.errorString()));
+        return false;
     }
+    buildFile.close();
 
     // Open the database in which the index will be stored.
-    if (!this->connectIndexDB()) {
-        qCritical("Existing index could not be opened");
+    const QString buildConnectionName = this->connectionName("build");
+    QSqlDatabase index = QSqlDatabase::contains(buildConnectionName)
+                         ? QSqlDatabase::database(buildConnectionName, false)
+                         : QSqlDatabase::addDatabase("QSQLITE", buildConnectionName);
+    index.close();
+    index.setDatabaseName(buildFile.fileName());
+    if (!index.open()) {
+        qCritical("New index could not be opened");
         return false;
     }
 
-    // Create the schema.
-    QSqlDatabase index = QSqlDatabase::database("index");
+    // Create the schema. Thousands of patterns share the same properties
+    // (those of their parent), so every distinct set of properties is stored
+    // only once, as a record. Patterns refer to their record by ID.
     QSqlQuery query(index);
-    if (!query.exec("CREATE TABLE browscap(pattern TEXT PRIMARY KEY, \
-                                           platform TEXT, \
-                                           browser_name TEXT, \
-                                           browser_version TEXT, \
-                                           browser_version_major INTEGER, \
-                                           browser_version_minor INTEGER, \
-                                           is_mobile INTEGER \
-                                           );")) {
+    if (!query.exec("CREATE TABLE metadata(name TEXT PRIMARY KEY, value INTEGER);")
+        || !query.exec("CREATE TABLE records(id INTEGER PRIMARY KEY, \
+                                             platform TEXT, \
+                                             browser_name TEXT, \
+                                             browser_version TEXT, \
+                                             browser_version_major INTEGER, \
+                                             browser_version_minor INTEGER, \
+                                             is_mobile INTEGER \
+                                             );")
+        || !query.exec("CREATE TABLE browscap(pattern TEXT PRIMARY KEY, \
+                                              pattern_length INTEGER, \
+                                              record_id INTEGER \
+                                              );"))
+    {
         qCritical("Failed to create table: %s.", qPrintable(query.lastError().text()));
         return false;
     }
+    QSqlQuery metadataQuery(index);
+    QSqlQuery recordQuery(index);
 
     // Parse the browscap.csv file.
     QFile csv(this->csvFile);
@@ -319,9 +458,14 @@ bool QBrowsCap::buildIndex(bool force, bool ignoreCrawlers, bool ignoreFeedReade
         bool hasJS, isBanned, isMobile, isCrawler, isFeedReader;
         bool parentHasJS = false, parentIsBanned = false, parentIsMobile = false, parentIsCrawler = false, parentIsFeedReader = false;
         QStringList parts;
+        QBrowsCapRecord record;
+        QHash<QBrowsCapRecord, quint32> recordIds;
+        quint32 recordId;
 
         int rows = 0;
-        query.prepare("INSERT INTO browscap VALUES(?, ?, ?, ?, ?, ?, ?);");
+        metadataQuery.prepare("INSERT INTO metadata VALUES(?, ?);");
+        recordQuery.prepare("INSERT INTO records VALUES(?, ?, ?, ?, ?, ?, ?);");
+        query.prepare("INSERT INTO browscap VALUES(?, ?, ?);");
 
         while (!in.atEnd()) {
             line = in.readLine();
@@ -331,14 +475,19 @@ bool QBrowsCap::buildIndex(bool force, bool ignoreCrawlers, bool ignoreFeedReade
             if (numLines <= 3) {
                 if (numLines == 2) {
                     // Store the version info.
-                    query.addBindValue(QBROWSCAP_INDEX_DB_VERSION_PATTERN);
-                    query.addBindValue("");
-                    query.addBindValue("");
-                    query.addBindValue(parts[0]);
-                    query.addBindValue(0);
-                    query.addBindValue(0);
-                    query.addBindValue(false);
-                    query.exec();
+                    metadataQuery.addBindValue(QBROWSCAP_INDEX_DB_VERSION_PATTERN);
+                    metadataQuery.addBindValue(parts[0].toInt());
+                    metadataQuery.exec();
+
+                    // Store the schema version.
+                    metadataQuery.addBindValue(QBROWSCAP_INDEX_DB_SCHEMA_VERSION_PATTERN);
+                    metadataQuery.addBindValue(QBROWSCAP_INDEX_DB_SCHEMA_VERSION);
+                    metadataQuery.exec();
+
+                    // Store the build ID.
+                    metadataQuery.addBindValue(QBROWSCAP_INDEX_DB_BUILD_ID_PATTERN);
+                    metadataQuery.addBindValue(buildId);
+                    metadataQuery.exec();
                 }
                 // Lines 1 and 3 don't contain anything useful. Line 2 is
                 // parsed above.
@@ -404,17 +553,171 @@ bool QBrowsCap::buildIndex(bool force, bool ignoreCrawlers, bool ignoreFeedReade
 
             rows++;
 
+            // Store the record, unless an earlier pattern has the same one.
+            record = QBrowsCapRecord(platform, browser, version, majorVersion, minorVersion, isMobile);
+            recordId = recordIds.value(record, 0);
+            if (recordId == 0) {
+                recordId = recordIds.size() + 1;
+                recordIds.insert(record, recordId);
+
+                recordQuery.addBindValue(recordId);
+                recordQuery.addBindValue(platform);
+                recordQuery.addBindValue(browser);
+                recordQuery.addBindValue(version);
+                recordQuery.addBindValue(majorVersion);
+                recordQuery.addBindValue(minorVersion);
+                recordQuery.addBindValue(isMobile);
+                recordQuery.exec();
+            }
+
             query.addBindValue(pattern);
-            query.addBindValue(platform);
-            query.addBindValue(browser);
-            query.addBindValue(version);
-            query.addBindValue(majorVersion);
-            query.addBindValue(minorVersion);
-            query.addBindValue(isMobile);
+            query.addBindValue(pattern.length());
+            query.addBindValue(recordId);
             query.exec();
         }
     }
 
+    if (!this->buildHotTier(index))
+        return false;
+
+    metadataQuery.clear();
+    recordQuery.clear();
+    query.clear();
+    index.close();
+
+    // QTemporaryFile creates files that only the owner can access, but other
+    // processes (possibly of other users) must be able to open the index.
+    if (QFile::exists(this->indexFile))
+        buildFile.setPermissions(QFile::permissions(this->indexFile));
+    else
+        buildFile.setPermissions(QFile::ReadOwner | QFile::WriteOwner | QFile::ReadGroup | QFile::ReadOther);
+
+    if (!replaceFile(buildFile.fileName(), this->indexFile)) {
+        qCritical("Existing index could not be replaced");
+        return false;
+    }
+    this->retireEngine();
+    this->attachEngine();
+
+    // The patterns of the profiled user agents may have changed.
+    this->profileMutex.lock();
+    this->profilePatterns.clear();
+    this->profileMutex.unlock();
+
+    // Answers in the shared cache were computed with the previous index.
+    if (this->sharedCache != NULL)
+        this->sharedCache->attach(this->indexFile, this->getEngine()->getBuildId(), this->sharedCacheSlots);
+
+    return true;
+}
+
+/**
+ * Whether the traffic profile has changed since the hot tier was built. The
+ * index file itself is modified by version checks, so its modification time
+ * can't be used.
+ */
+bool QBrowsCap::hotTierIsOutdated() const {
+    QFileInfo profileInfo(this->getProfileFile());
+    return profileInfo.exists()
+           && (int) profileInfo.lastModified().toTime_t() != this->getIndexMetadata(QBROWSCAP_INDEX_DB_PROFILE_TIMESTAMP_PATTERN);
+}
+
+/**
+ * Build the hot tier of the index: a small table with the patterns that
+ * matched most often according to the traffic profile, if any. Lookups try
+ * it first, and only search the full table when no hot pattern matches.
+ * A user agent that matches a hot pattern therefore gets that pattern, even
+ * when a longer pattern that the profile never saw would match it too: use
+ * shadow mode with QBrowsCapReferenceMatcher to measure how often that
+ * happens for real traffic. Both tables are indexed on the pattern length,
+ * so that lookups can try the longest patterns first and stop at the first
+ * match.
+ */
+bool QBrowsCap::buildHotTier(QSqlDatabase & index) {
+    QSqlQuery query(index);
+
+    // Remember which version of the profile the hot tier was built with.
+    QFileInfo profileInfo(this->getProfileFile());
+    query.prepare("INSERT INTO metadata VALUES(?, ?);");
+    query.addBindValue(QBROWSCAP_INDEX_DB_PROFILE_TIMESTAMP_PATTERN);
+    query.addBindValue(profileInfo.exists() ? (int) profileInfo.lastModified().toTime_t() : 0);
+    query.exec();
+
+    if (!query.exec("CREATE TABLE browscap_hot AS SELECT *, 0 AS hits FROM browscap WHERE 0;")
+        || !query.exec("CREATE INDEX browscap_pattern_length ON browscap(pattern_length);")
+        || !query.exec("CREATE INDEX browscap_hot_pattern_length ON browscap_hot(pattern_length);"))
+    {
+        qCritical("Failed to create the hot tier: %s.", qPrintable(query.lastError().text()));
+        return false;
+    }
+
+    // Sort the profiled patterns by their number of hits.
+    QHash<QString, quint64> profile = this->loadProfile();
+    QMap<quint64, QString> patternsByHits;
+    for (QHash<QString, quint64>::const_iterator i = profile.constBegin(); i != profile.constEnd(); ++i)
+        patternsByHits.insertMulti(i.value(), i.key());
+
+    query.prepare("INSERT INTO browscap_hot SELECT *, ? FROM browscap WHERE pattern = ?;");
+    QMap<quint64, QString>::const_iterator i = patternsByHits.constEnd();
+    int numPatterns = 0;
+    while (i != patternsByHits.constBegin() && numPatterns < QBROWSCAP_HOT_TIER_MAX_PATTERNS) {
+        --i;
+        query.addBindValue(i.key());
+        query.addBindValue(i.value());
+        query.exec();
+        numPatterns++;
+    }
+
+    return true;
+}
+
+/**
+ * Load the traffic profile: the number of hits per pattern.
+ */
+QHash<QString, quint64> QBrowsCap::loadProfile() const {
+    QHash<QString, quint64> profile;
+    QFile file(this->getProfileFile());
+    QString line;
+    int tab;
+
+    if (file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        QTextStream in(&file);
+        while (!in.atEnd()) {
+            line = in.readLine();
+            tab = line.indexOf('\t');
+            if (tab > 0)
+                profile[line.mid(tab + 1)] += line.left(tab).toULongLong();
+        }
+    }
+
+    return profile;
+}
+
+/**
+ * Add the hit counts that were collected while profiling to the traffic
+ * profile next to the index. The next buildIndex() will use it to build the
+ * hot tier.
+ */
+bool QBrowsCap::saveProfile() {
+    QHash<QString, quint64> profile = this->loadProfile();
+
+    this->profileMutex.lock();
+    for (QHash<QString, quint64>::const_iterator i = this->profile.constBegin(); i != this->profile.constEnd(); ++i)
+        profile[i.key()] += i.value();
+    this->profile.clear();
+    this->profilePatterns.clear();
+    this->profileMutex.unlock();
+
+    QFile file(this->getProfileFile());
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Truncate)) {
+        qCritical("Could not open '%s' file for writing: %s.", qPrintable(this->getProfileFile()), qPrintable(file.errorString()));
+        return false;
+    }
+
+    QTextStream out(&file);
+    for (QHash<QString, quint64>::const_iterator i = profile.constBegin(); i != profile.constEnd(); ++i)
+        out << i.value() << '\t' << i.key() << '\n';
+
     return true;
 }
 
@@ -480,59 +783,431 @@ void QBrowsCap::downloadFinished(QNetworkReply * reply) {
     }
 }
 
+/**
+ * Use a cache that is shared with all other processes that use the same
+ * index file, instead of a cache per QBrowsCap instance. Then a lookup in one
+ * process warms the cache for all of them, and the memory used for caching
+ * is bounded by the number of slots. Must be called after the index has been
+ * built, and not while lookups are in progress.
+ *
+ * @param numSlots
+ *   The maximum number of cached user agents. Only has an effect for the
+ *   first process that enables the shared cache.
+ * @return
+ *   True if the shared cache is available.
+ */
+bool QBrowsCap::enableSharedCache(int numSlots) {
+    if (this->sharedCache == NULL)
+        this->sharedCache = new QBrowsCapSharedCache();
+    this->sharedCacheSlots = numSlots;
+
+    if (!this->sharedCache->attach(this->indexFile, this->getEngine()->getBuildId(), numSlots)) {
+        this->disableSharedCache();
+        return false;
+    }
+
+    return true;
+}
+
+void QBrowsCap::disableSharedCache() {
+    delete this->sharedCache;
+    this->sharedCache = NULL;
+}
+
+/**
+ * Enable shadow mode: repeat a sample of the index lookups with another
+ * matching engine on a background thread, to compare answers and latencies
+ * under real load without affecting the lookups themselves. Only lookups
+ * that miss the cache are sampled. Must not be called while lookups are in
+ * progress.
+ *
+ * @param matcher
+ *   The shadow engine, or NULL to disable shadow mode. QBrowsCap does not
+ *   take ownership.
+ * @param sampleRate
+ *   The fraction of lookups to sample, between 0 and 1.
+ */
+void QBrowsCap::setShadowMatcher(QBrowsCapMatcher * matcher, double sampleRate) {
+    if (this->shadowMatcher != NULL)
+        this->shadowPool.waitForDone();
+
+    this->shadowMatcher = (sampleRate > 0) ? matcher : NULL;
+    this->shadowSampleInterval = (sampleRate > 0) ? qMax(1, qRound(1.0 / sampleRate)) : 1;
+}
+
+QBrowsCapShadowReport QBrowsCap::getShadowReport() {
+    QMutexLocker locker(&this->shadowMutex);
+    return this->shadowReport;
+}
+
+void QBrowsCap::resetShadowReport() {
+    QMutexLocker locker(&this->shadowMutex);
+    this->shadowReport = QBrowsCapShadowReport();
+}
+
 /**
  * Match the user agent string
  */
 QPair<bool, QBrowsCapRecord> QBrowsCap::matchUserAgent(const QString & userAgent) {
+    // The record must come from the same engine as its ID: the index may be
+    // rebuilt in the meantime.
+    QSharedPointer<QBrowsCapEngine> engine = this->getEngine();
+    const quint32 id = this->matchUserAgentId(userAgent, engine.data());
+    return qMakePair(id != 0, engine->getRecord(id));
+}
+
+/**
+ * Match the user agent string within a time budget. If the answer is not
+ * cached, the full lookup runs in the background. If it doesn't finish in
+ * time (for example because the user agent requires a slow scan of the
+ * index, or because the cache is locked) a degraded answer is returned: the
+ * best match in the hot tier of the index, which only holds the patterns that
+ * match most traffic, so it is fast to query, but which may miss a more
+ * specific pattern. Without a hot match, the user agent is reported as
+ * unidentifiable. The lookup then continues, so that a later call will find
+ * the answer in the cache.
+ *
+ * @param timeBudget
+ *   The maximum time to spend, in milliseconds.
+ * @param degraded
+ *   Set to true when the answer is degraded. May be NULL.
+ */
+QPair<bool, QBrowsCapRecord> QBrowsCap::matchUserAgent(const QString & userAgent, int timeBudget, bool * degraded) {
     QPair<bool, QBrowsCapRecord> answer;
-    static bool indexConnected = false;
+    QSharedPointer<QBrowsCapPendingLookup> pending;
+    QSharedPointer<QBrowsCapEngine> engine;
+    QElapsedTimer timer;
+    quint32 id = 0;
+    bool ok = false, done;
 
-    if (!indexConnected)
-        this->connectIndexDB();
+    timer.start();
+    if (degraded != NULL)
+        *degraded = false;
 
-    this->cacheMutex.lock();
-    if (!this->cache.contains(userAgent)) {
-        this->cacheMutex.unlock();
+    // Don't queue behind the engine's mutex beyond the budget, and leave
+    // attaching to a (re)built index, which loads its records, to the
+    // background lookup.
+    if (this->engineMutex.tryLock(qMax(timeBudget, 0))) {
+        if (!this->engine.isNull() && !this->engine->isRetired())
+            engine = this->engine;
+        this->engineMutex.unlock();
+    }
 
-        QSqlDatabase index = QSqlDatabase::database("index");
-        QSqlQuery query(index);
-        query.prepare("SELECT platform, \
-                              browser_name, browser_version, \
-                              browser_version_major, browser_version_minor, \
-                              is_mobile \
-                       FROM browscap \
-                       WHERE ? GLOB pattern \
-                       ORDER BY LENGTH(pattern) \
-                       DESC LIMIT 1");
-        query.addBindValue(userAgent);
-        query.exec();
-        if (query.next()) {
-            answer.first = true;
-            answer.second = QBrowsCapRecord(query.value(0).toString(),
-                                            query.value(1).toString(),
-                                            query.value(2).toString(),
-                                            query.value(3).toInt(),
-                                            query.value(4).toInt(),
-                                            query.value(5).toBool());
+    if (!engine.isNull()) {
+        // Try the cache, but don't queue behind its mutex beyond the budget
+        // either.
+        if (this->usesSharedCache(engine.data())) {
+            if (this->sharedCache->lookup(userAgent, id))
+                return qMakePair(id != 0, engine->getRecord(id));
         }
         else {
-            // No match: unidentifiable user agent.
-            answer.first = false;
+            if (engine->lookup(userAgent, id, qMax(timeBudget - timer.elapsed(), (qint64) 0)))
+                return qMakePair(id != 0, engine->getRecord(id));
         }
 
-        this->cacheMutex.lock();
-        this->cache.insert(userAgent, answer);
-        this->cacheMutex.unlock();
+        // The query may wait for SQLite's busy timeout, so only start it
+        // while there is budget left.
+        if (timer.elapsed() < timeBudget)
+            id = this->queryIndex(userAgent, engine.data(), &ok, true);
+    }
+
+    // Resolve the user agent in the background (which also caches the
+    // answer), unless that is already happening for an earlier call. At most
+    // QBROWSCAP_MAX_PENDING_LOOKUPS lookups are queued; beyond that, lookups
+    // are not finished in the background.
+    this->pendingMutex.lock();
+    pending = this->pendingLookups.value(userAgent);
+    if (pending.isNull() && this->pendingLookups.size() < QBROWSCAP_MAX_PENDING_LOOKUPS) {
+        pending = QSharedPointer<QBrowsCapPendingLookup>(new QBrowsCapPendingLookup());
+        this->pendingLookups.insert(userAgent, pending);
+        this->lookupPool.start(new QBrowsCapLookupTask(this, userAgent, pending));
+    }
+    this->pendingMutex.unlock();
+
+    // Wait for the remainder of the budget.
+    done = false;
+    if (!pending.isNull()) {
+        pending->mutex.lock();
+        if (!pending->done)
+            pending->finished.wait(&pending->mutex, (unsigned long) qMax(timeBudget - timer.elapsed(), (qint64) 0));
+        done = pending->done;
+        answer = pending->answer;
+        pending->mutex.unlock();
     }
-    else {
-        this->cacheMutex.unlock();
 
-        answer = this->cache.value(userAgent);
+    // Fall back to the hot match, if any.
+    if (!done) {
+        if (degraded != NULL)
+            *degraded = true;
+        if (ok && id != 0)
+            answer = qMakePair(true, engine->getRecord(id));
+        else
+            answer = QPair<bool, QBrowsCapRecord>();
     }
 
     return answer;
 }
 
+QBrowsCapLookupTask::QBrowsCapLookupTask(QBrowsCap * browsCap, const QString & userAgent, QSharedPointer<QBrowsCapPendingLookup> pending) {
+    this->browsCap = browsCap;
+    this->userAgent = userAgent;
+    this->pending = pending;
+}
+
+void QBrowsCapLookupTask::run() {
+    // This stores the answer in the cache.
+    QPair<bool, QBrowsCapRecord> answer = this->browsCap->matchUserAgent(this->userAgent);
+
+    this->browsCap->pendingMutex.lock();
+    this->browsCap->pendingLookups.remove(this->userAgent);
+    this->browsCap->pendingMutex.unlock();
+
+    QMutexLocker locker(&this->pending->mutex);
+    this->pending->answer = answer;
+    this->pending->done = true;
+    this->pending->finished.wakeAll();
+}
+
+/**
+ * Match the user agent string, but return the ID of the matching record
+ * instead of a copy of it. Record IDs are stored in the index, so they are
+ * the same for all instances (and processes) that use the same index, and
+ * equal answers have equal IDs.
+ *
+ * @return
+ *   The record ID, or 0 if the user agent could not be identified.
+ */
+quint32 QBrowsCap::matchUserAgentId(const QString & userAgent) {
+    return this->matchUserAgentId(userAgent, this->getEngine().data());
+}
+
+quint32 QBrowsCap::matchUserAgentId(const QString & userAgent, QBrowsCapEngine * engine) {
+    quint32 id;
+    bool ok;
+
+    // The shared cache replaces the engine's cache. Answers of failed index
+    // queries are not cached, so the next lookup retries.
+    if (this->usesSharedCache(engine)) {
+        if (!this->sharedCache->lookup(userAgent, id)) {
+            id = this->resolve(userAgent, engine, &ok);
+            if (ok)
+                this->sharedCache->insert(userAgent, id);
+        }
+    }
+    else if (!engine->lookup(userAgent, id)) {
+        id = this->resolve(userAgent, engine, &ok);
+        if (ok)
+            engine->insert(userAgent, id);
+    }
+
+    if (this->profiling)
+        this->profileHit(userAgent, engine);
+
+    return id;
+}
+
+/**
+ * Get the record with the given ID, as returned by matchUserAgentId().
+ */
+QBrowsCapRecord QBrowsCap::getRecord(quint32 id) {
+    return this->getEngine()->getRecord(id);
+}
+
+/**
+ * Look up a user agent that isn't cached in the index. In shadow mode, a
+ * sample of these lookups is also sent to the shadow engine.
+ *
+ * @param ok
+ *   Set to false if the index could not be queried.
+ */
+quint32 QBrowsCap::resolve(const QString & userAgent, QBrowsCapEngine * engine, bool * ok) {
+    QBrowsCapMatcher * matcher = this->shadowMatcher;
+    if (matcher == NULL)
+        return this->queryIndex(userAgent, engine, ok);
+
+    QElapsedTimer timer;
+    timer.start();
+    const quint32 id = this->queryIndex(userAgent, engine, ok);
+    const qint64 latency = timer.nsecsElapsed() / 1000;
+
+    if (*ok && (uint) this->shadowCounter.fetchAndAddRelaxed(1) % (uint) this->shadowSampleInterval == 0) {
+        // Never let the shadow engine hold back the primary one: drop samples
+        // when it can't keep up.
+        QMutexLocker locker(&this->shadowMutex);
+        if (this->shadowPending >= QBROWSCAP_SHADOW_MAX_PENDING)
+            this->shadowReport.dropped++;
+        else {
+            this->shadowPending++;
+            this->shadowPool.start(new QBrowsCapShadowTask(this, matcher, userAgent, qMakePair(id != 0, engine->getRecord(id)), latency));
+        }
+    }
+
+    return id;
+}
+
+/**
+ * Compare an answer of the shadow engine with the answer of the index. When
+ * the shadow engine failed to answer, only the failure is counted.
+ */
+void QBrowsCap::recordShadowResult(const QString & userAgent,
+                                   const QPair<bool, QBrowsCapRecord> & primary, qint64 primaryLatency,
+                                   const QPair<bool, QBrowsCapRecord> & shadow, qint64 shadowLatency,
+                                   bool shadowOk)
+{
+    const bool agree = (primary.first == shadow.first) && (!primary.first || primary.second == shadow.second);
+
+    QMutexLocker locker(&this->shadowMutex);
+    this->shadowPending--;
+    if (!shadowOk) {
+        this->shadowReport.errors++;
+        return;
+    }
+    this->shadowReport.samples++;
+    this->shadowReport.primaryLatencies[QBrowsCapShadowReport::bucket(primaryLatency)]++;
+    this->shadowReport.shadowLatencies[QBrowsCapShadowReport::bucket(shadowLatency)]++;
+    if (agree)
+        this->shadowReport.agreements++;
+    else {
+        this->shadowReport.disagreements++;
+        if (this->shadowReport.examples.size() < QBROWSCAP_SHADOW_MAX_EXAMPLES) {
+            QBrowsCapShadowDisagreement disagreement;
+            disagreement.userAgent = userAgent;
+            disagreement.primary = primary;
+            disagreement.shadow = shadow;
+            this->shadowReport.examples << disagreement;
+        }
+    }
+}
+
+/**
+ * Find the most specific (i.e. longest) pattern in the index that matches the
+ * user agent. The hot tier is queried first; the full index then only has to
+ * be searched for longer patterns than the one that matched there.
+ *
+ * @param hotTierOnly
+ *   Only query the hot tier. The answer may then not be the most specific.
+ * @param ok
+ *   Set to false if the index could not be queried. The user agent is then
+ *   reported as unidentifiable, but that answer must not be cached.
+ * @return
+ *   The ID of the pattern's record, or 0 if no pattern matches.
+ */
+quint32 QBrowsCap::queryIndex(const QString & userAgent, QBrowsCapEngine * engine, bool * ok, bool hotTierOnly) {
+    quint32 id = 0;
+    int patternLength = 0;
+    QString pattern;
+
+    *ok = false;
+    QSqlQuery query(engine->database());
+
+    // The hot tier contains the patterns that match most traffic.
+    query.prepare("SELECT pattern, pattern_length, record_id \
+                   FROM browscap_hot \
+                   WHERE ? GLOB pattern \
+                   ORDER BY pattern_length \
+                   DESC LIMIT 1");
+    query.addBindValue(userAgent);
+    if (!query.exec()) {
+        qWarning("Could not query the index: %s.", qPrintable(query.lastError().text()));
+        return 0;
+    }
+    if (query.next()) {
+        pattern = query.value(0).toString();
+        patternLength = query.value(1).toInt();
+        id = query.value(2).toUInt();
+    }
+
+    if (!hotTierOnly) {
+        // Only a longer pattern can be a more specific match.
+        query.prepare("SELECT pattern, record_id \
+                       FROM browscap \
+                       WHERE pattern_length > ? AND ? GLOB pattern \
+                       ORDER BY pattern_length \
+                       DESC LIMIT 1");
+        query.addBindValue(patternLength);
+        query.addBindValue(userAgent);
+        if (!query.exec()) {
+            qWarning("Could not query the index: %s.", qPrintable(query.lastError().text()));
+            return 0;
+        }
+        if (query.next()) {
+            pattern = query.value(0).toString();
+            id = query.value(1).toUInt();
+        }
+    }
+
+    // Remember the pattern, so that later lookups of this user agent that
+    // are answered by the cache can be counted as well.
+    if (this->profiling && !hotTierOnly) {
+        QMutexLocker locker(&this->profileMutex);
+        if (this->profilePatterns.size() >= QBROWSCAP_PROFILE_MAX_USER_AGENTS)
+            this->profilePatterns.clear();
+        this->profilePatterns.insert(userAgent, pattern);
+    }
+
+    *ok = true;
+    return id;
+}
+
+/**
+ * Count a lookup in the traffic profile.
+ */
+void QBrowsCap::profileHit(const QString & userAgent, QBrowsCapEngine * engine) {
+    bool ok;
+
+    this->profileMutex.lock();
+    bool known = this->profilePatterns.contains(userAgent);
+    this->profileMutex.unlock();
+
+    // The answer came from a cache that was filled before profiling was
+    // enabled (or by another process): look up its pattern once.
+    if (!known)
+        this->queryIndex(userAgent, engine, &ok);
+
+    QMutexLocker locker(&this->profileMutex);
+    const QString pattern = this->profilePatterns.value(userAgent);
+    if (!pattern.isEmpty())
+        this->profile[pattern]++;
+}
+
+bool operator==(const QBrowsCapRecord & a, const QBrowsCapRecord & b) {
+    return a.browser_version_major == b.browser_version_major
+           && a.browser_version_minor == b.browser_version_minor
+           && a.is_mobile == b.is_mobile
+           && a.browser_name == b.browser_name
+           && a.browser_version == b.browser_version
+           && a.platform == b.platform;
+}
+
+uint qHash(const QBrowsCapRecord & record) {
+    return qHash(record.browser_name)
+           ^ (qHash(record.browser_version) << 1)
+           ^ (qHash(record.platform) << 2)
+           ^ (record.browser_version_major << 16)
+           ^ record.browser_version_minor
+           ^ (record.is_mobile ? 0x80000000 : 0);
+}
+
+QDataStream & operator<<(QDataStream & out, const QBrowsCapRecord & record) {
+    out << record.platform
+        << record.browser_name
+        << record.browser_version
+        << record.browser_version_major
+        << record.browser_version_minor
+        << record.is_mobile;
+    return out;
+}
+
+QDataStream & operator>>(QDataStream & in, QBrowsCapRecord & record) {
+    in >> record.platform
+       >> record.browser_name
+       >> record.browser_version
+       >> record.browser_version_major
+       >> record.browser_version_minor
+       >> record.is_mobile;
+    return in;
+}
+
 #ifdef DEBUG
 QDebug operator<<(QDebug dbg, const QBrowsCapRecord & record) {
     dbg.nospace() << record.browser_name.toStdString().c_str() << " " << record.browser_version.toStdString().c_str()
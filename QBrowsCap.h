@@ -3,6 +3,8 @@
 
 
 #include <QMap>
+#include <QHash>
+#include <QVector>
 #include <QStringList>
 #include <QUrl>
 #include <QNetworkAccessManager>
@@ -11,6 +13,7 @@
 #include <QObject>
 #include <QFile>
 #include <QFileInfo>
+#include <QTemporaryFile>
 #include <QSqlDatabase>
 #include <QSqlQuery>
 #include <QSqlError>
@@ -19,9 +22,21 @@
 #include <QDateTime>
 #include <QMutex>
 #include <QMutexLocker>
+#include <QWaitCondition>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSharedPointer>
+#include <QElapsedTimer>
+#include <QAtomicInt>
 #include <QTextStream>
+#include <QDataStream>
 #include <QMetaType>
 #include <QDebug>
+#include "QBrowsCapRecord.h"
+#include "QBrowsCapEngine.h"
+#include "QBrowsCapSharedCache.h"
+#include "QBrowsCapShadow.h"
 
 
 #define QBROWSCAP_CSV_URL "http://browsers.garykeith.com/stream.asp?BrowsCapCSV"
@@ -29,59 +44,82 @@
 #define QBROWSCAP_INDEX_DB_VERSION_PATTERN "___QBROWSCAP_VERSION___"
 #define QBROWSCAP_INDEX_DB_LAST_VERSION_PATTERN "___QBROWSCAP_LAST_VERSION___"
 #define QBROWSCAP_INDEX_DB_LAST_VERSION_CHECK_PATTERN "___QBROWSCAP_LAST_VERSION_CHECK___"
+#define QBROWSCAP_INDEX_DB_SCHEMA_VERSION_PATTERN "___QBROWSCAP_SCHEMA_VERSION___"
+#define QBROWSCAP_INDEX_DB_PROFILE_TIMESTAMP_PATTERN "___QBROWSCAP_PROFILE_TIMESTAMP___"
+#define QBROWSCAP_INDEX_DB_BUILD_ID_PATTERN "___QBROWSCAP_BUILD_ID___"
+#define QBROWSCAP_INDEX_DB_SCHEMA_VERSION 3
 #define QBROWSCAP_MIN_UPDATE_INTERVAL 86400 // Allow only daily updates.
+#define QBROWSCAP_PROFILE_SUFFIX ".profile"
+#define QBROWSCAP_HOT_TIER_MAX_PATTERNS 512
+#define QBROWSCAP_PROFILE_MAX_USER_AGENTS 65536
+#define QBROWSCAP_MAX_PENDING_LOOKUPS 1024
 
 
-struct QBrowsCapRecord {
-    QBrowsCapRecord() {}
-    ~QBrowsCapRecord() {}
-    QBrowsCapRecord(QString platform, QString browser_name,
-                    QString browser_version, quint16 browser_version_major,
-                    quint16 browser_version_minor, bool is_mobile)
-    {
-        this->platform              = platform;
-        this->browser_name          = browser_name;;
-        this->browser_version       = browser_version;
-        this->browser_version_major = browser_version_major;
-        this->browser_version_minor = browser_version_minor;
-        this->is_mobile             = is_mobile;
-    }
-
-    QString platform;
-    QString browser_name;
-    QString browser_version;
-    quint16 browser_version_major;
-    quint16 browser_version_minor;
-    bool    is_mobile;
+class QBrowsCap;
+
+// A lookup that is being resolved in the background, on behalf of a
+// deadline-bounded matchUserAgent() call.
+struct QBrowsCapPendingLookup {
+    QBrowsCapPendingLookup() : done(false) {}
+
+    QMutex mutex;
+    QWaitCondition finished;
+    bool done;
+    QPair<bool, QBrowsCapRecord> answer;
 };
 
-// Register metatype to allow these types to be streamed in QTests.
-Q_DECLARE_METATYPE(QBrowsCapRecord)
+class QBrowsCapLookupTask : public QRunnable {
+public:
+    QBrowsCapLookupTask(QBrowsCap * browsCap, const QString & userAgent, QSharedPointer<QBrowsCapPendingLookup> pending);
+    void run();
 
-#ifdef DEBUG
-// QDebug() streaming output operators.
-QDebug operator<<(QDebug dbg, const QBrowsCapRecord & record);
-#endif
+protected:
+    QBrowsCap * browsCap;
+    QString userAgent;
+    QSharedPointer<QBrowsCapPendingLookup> pending;
+};
 
 class QBrowsCap : public QObject {
     Q_OBJECT
 
+    friend class QBrowsCapLookupTask;
+    friend class QBrowsCapShadowTask;
+    friend class QBrowsCapAggregator;
+
 public:
     QBrowsCap();
     QBrowsCap(const QString & csvFile);
     QBrowsCap(const QString & csvFile, const QString & indexFile);
+    ~QBrowsCap();
 
     void setCsvFile(const QString & csvFile);
     void setIndexFile(const QString & indexFile);
+    QString getCsvFile() const { return this->csvFile; }
+    QString getIndexFile() const { return this->indexFile; }
 
     bool selfUpdate();
 
     int getCsvVersion() const;
     int getLatestVersion();
     int getIndexVersion() const;
+    int getIndexSchemaVersion() const;
+    int getIndexBuildId() const;
+
+    int getCacheSize() { return this->getEngine()->getCacheSize(); }
+    void resetCache() { this->getEngine()->resetCache(); }
+
+    bool enableSharedCache(int numSlots = QBROWSCAP_SHARED_CACHE_DEFAULT_SLOTS);
+    void disableSharedCache();
 
-    int getCacheSize() { QMutexLocker(&this->cacheMutex); return this->cache.size(); }
-    void resetCache() { QMutexLocker(&this->cacheMutex); this->cache.clear(); }
+    void setProfilingEnabled(bool enabled) { this->profiling = enabled; }
+    bool isProfilingEnabled() const { return this->profiling; }
+    QString getProfileFile() const { return this->indexFile + QBROWSCAP_PROFILE_SUFFIX; }
+    bool saveProfile();
+
+    void setShadowMatcher(QBrowsCapMatcher * matcher, double sampleRate = 0.01);
+    QBrowsCapShadowReport getShadowReport();
+    void resetShadowReport();
+    void waitForShadowLookups() { this->shadowPool.waitForDone(); }
 
     bool isUpToDate();
     bool downloadUpdate(const QString & targetPath);
@@ -89,6 +127,9 @@ public:
     bool buildIndex(bool force = false, bool ignoreCrawlers = true, bool ignorFeedReaders = true, bool ignoreBanned = true, bool ignoreNoJS = true);
 
     QPair<bool, QBrowsCapRecord> matchUserAgent(const QString & userAgent);
+    QPair<bool, QBrowsCapRecord> matchUserAgent(const QString & userAgent, int timeBudget, bool * degraded);
+    quint32 matchUserAgentId(const QString & userAgent);
+    QBrowsCapRecord getRecord(quint32 id);
 
 protected slots:
     void downloadFinished(QNetworkReply * reply);
@@ -105,8 +146,39 @@ protected:
     int latestVersion;
 
     // The two speed-up layers: the index is persistent, the cache is not.
-    //QSqlDatabase index;
-    QMap<QString, QPair<bool, QBrowsCapRecord> > cache;
+    // Both live in an engine that is shared with all other instances in this
+    // process that use the same index.
+    QSharedPointer<QBrowsCapEngine> engine;
+    QMutex engineMutex;
+
+    // Optionally, the cache is shared with other processes instead.
+    QBrowsCapSharedCache * sharedCache;
+    int sharedCacheSlots;
+
+    // Per-pattern hit counts, collected while profiling is enabled. Used to
+    // build the hot tier of the index. Every lookup counts, also when it is
+    // answered by the cache, so the pattern of each user agent is kept, for
+    // at most QBROWSCAP_PROFILE_MAX_USER_AGENTS user agents: beyond that, and
+    // whenever the profile is saved, they are forgotten and looked up again.
+    bool profiling;
+    QHash<QString, quint64> profile;
+    QHash<QString, QString> profilePatterns;
+    QMutex profileMutex;
+
+    // Lookups that exceeded their time budget are finished in the background.
+    QThreadPool lookupPool;
+    QMutex pendingMutex;
+    QHash<QString, QSharedPointer<QBrowsCapPendingLookup> > pendingLookups;
+
+    // Shadow mode: a sample of the index lookups is repeated with another
+    // engine in the background, and the answers and latencies are compared.
+    QBrowsCapMatcher * shadowMatcher;
+    int shadowSampleInterval;
+    QAtomicInt shadowCounter;
+    int shadowPending;
+    QThreadPool shadowPool;
+    QMutex shadowMutex;
+    QBrowsCapShadowReport shadowReport;
 
     // The browscap.csv file.
     QString csvFile;
@@ -114,13 +186,24 @@ protected:
     // The corresponding index (a SQLite DB).
     QString indexFile;
 
-    // Mutexes are necessary to make the SQLite DB queries and the cache
-    // lookups/insertions thread-safe (all calls are serialized).
-    QMutex queryMutex;
-    QMutex cacheMutex;
-
     void init();
-    bool connectIndexDB();
+    QString connectionName(const QString & purpose) const;
+    QSharedPointer<QBrowsCapEngine> getEngine();
+    void attachEngine();
+    void retireEngine();
+    bool usesSharedCache(const QBrowsCapEngine * engine);
+    int getIndexMetadata(const QString & pattern) const;
+    QHash<QString, quint64> loadProfile() const;
+    bool hotTierIsOutdated() const;
+    bool buildHotTier(QSqlDatabase & index);
+    void profileHit(const QString & userAgent, QBrowsCapEngine * engine);
+    quint32 matchUserAgentId(const QString & userAgent, QBrowsCapEngine * engine);
+    quint32 queryIndex(const QString & userAgent, QBrowsCapEngine * engine, bool * ok, bool hotTierOnly = false);
+    quint32 resolve(const QString & userAgent, QBrowsCapEngine * engine, bool * ok);
+    void recordShadowResult(const QString & userAgent,
+                            const QPair<bool, QBrowsCapRecord> & primary, qint64 primaryLatency,
+                            const QPair<bool, QBrowsCapRecord> & shadow, qint64 shadowLatency,
+                            bool shadowOk);
 };
 
 #endif // QBROWSCAP_H
@@ -7,5 +7,16 @@ CONFIG(release, debug|release):DEFINES += QT_NO_DEBUG_OUTPUT
 # Add a DEBUG define when in debug mode.
 CONFIG(debug, debug|release):DEFINES += DEBUG
 
-HEADERS += QBrowsCap.h
-SOURCES += QBrowsCap.cpp
+HEADERS += QBrowsCap.h \
+           QBrowsCapAggregator.h \
+           QBrowsCapClient.h \
+           QBrowsCapEngine.h \
+           QBrowsCapRecord.h \
+           QBrowsCapShadow.h \
+           QBrowsCapSharedCache.h
+SOURCES += QBrowsCap.cpp \
+           QBrowsCapAggregator.cpp \
+           QBrowsCapClient.cpp \
+           QBrowsCapEngine.cpp \
+           QBrowsCapShadow.cpp \
+           QBrowsCapSharedCache.cpp
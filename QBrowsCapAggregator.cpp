@@ -0,0 +1,157 @@
+#include "QBrowsCapAggregator.h"
+
+QBrowsCapAggregator::QBrowsCapAggregator(QBrowsCap * browsCap, Fields groupBy) {
+    static QAtomicInt nextId;
+
+    this->browsCap = browsCap;
+    this->groupBy = groupBy;
+    this->id = nextId.fetchAndAddRelaxed(1);
+}
+
+/**
+ * Count a user agent. May be called from multiple threads concurrently.
+ */
+void QBrowsCapAggregator::add(const QString & userAgent, quint64 count) {
+    // The ID must be counted in a partial aggregate for the same engine.
+    QSharedPointer<QBrowsCapEngine> engine = this->browsCap->getEngine();
+    const quint32 id = this->browsCap->matchUserAgentId(userAgent, engine.data());
+    QSharedPointer<QBrowsCapAggregatorPartial> partial = this->localPartial(engine);
+
+    // Only contended while getResults() or reset() is running.
+    QMutexLocker locker(&partial->mutex);
+    partial->counts[id] += count;
+}
+
+/**
+ * Count every line of a device as a user agent.
+ *
+ * @return
+ *   The number of lines that were counted.
+ */
+quint64 QBrowsCapAggregator::addAll(QIODevice * device) {
+    quint64 numLines = 0;
+    QByteArray line;
+
+    while (!device->atEnd()) {
+        line = device->readLine();
+        if (line.endsWith('\n'))
+            line.chop(1);
+        if (line.endsWith('\r'))
+            line.chop(1);
+        this->add(QString::fromUtf8(line.constData(), line.size()));
+        numLines++;
+    }
+
+    return numLines;
+}
+
+/**
+ * Merge the counts of all threads and group them.
+ */
+QList<QBrowsCapAggregate> QBrowsCapAggregator::getResults() {
+    QHash<QBrowsCapEngine *, QHash<quint32, quint64> > counts;
+    QHash<quint32, quint64>::const_iterator i;
+
+    this->partialsMutex.lock();
+    const QList<QSharedPointer<QBrowsCapAggregatorPartial> > partials = this->partials;
+    this->partialsMutex.unlock();
+
+    foreach (const QSharedPointer<QBrowsCapAggregatorPartial> & partial, partials) {
+        QMutexLocker locker(&partial->mutex);
+        QHash<quint32, quint64> & engineCounts = counts[partial->engine.data()];
+        for (i = partial->counts.constBegin(); i != partial->counts.constEnd(); ++i)
+            engineCounts[i.key()] += i.value();
+    }
+
+    // Only now look at the records: once per distinct record of each engine.
+    // The partials keep the engines alive.
+    QHash<QBrowsCapRecord, quint64> groups;
+    quint64 unmatched = 0;
+    QBrowsCapRecord record, key;
+    QHash<QBrowsCapEngine *, QHash<quint32, quint64> >::const_iterator e;
+    for (e = counts.constBegin(); e != counts.constEnd(); ++e) {
+        for (i = e.value().constBegin(); i != e.value().constEnd(); ++i) {
+            if (i.key() == 0) {
+                unmatched += i.value();
+                continue;
+            }
+
+            record = e.key()->getRecord(i.key());
+            key = QBrowsCapRecord();
+            if (this->groupBy & Platform)
+                key.platform = record.platform;
+            if (this->groupBy & BrowserName)
+                key.browser_name = record.browser_name;
+            if (this->groupBy & BrowserVersion)
+                key.browser_version = record.browser_version;
+            if (this->groupBy & BrowserVersionMajor)
+                key.browser_version_major = record.browser_version_major;
+            if (this->groupBy & BrowserVersionMinor)
+                key.browser_version_minor = record.browser_version_minor;
+            if (this->groupBy & IsMobile)
+                key.is_mobile = record.is_mobile;
+            groups[key] += i.value();
+        }
+    }
+
+    QList<QBrowsCapAggregate> results;
+    QBrowsCapAggregate aggregate;
+    QHash<QBrowsCapRecord, quint64>::const_iterator g;
+    for (g = groups.constBegin(); g != groups.constEnd(); ++g) {
+        aggregate.matched = true;
+        aggregate.record = g.key();
+        aggregate.count = g.value();
+        results << aggregate;
+    }
+    if (unmatched > 0) {
+        aggregate.matched = false;
+        aggregate.record = QBrowsCapRecord();
+        aggregate.count = unmatched;
+        results << aggregate;
+    }
+
+    return results;
+}
+
+/**
+ * Forget all counts. This also releases the engines of rebuilt indexes:
+ * threads create new partial aggregates when they count again.
+ */
+void QBrowsCapAggregator::reset() {
+    QMutexLocker locker(&this->partialsMutex);
+    this->partials.clear();
+}
+
+/**
+ * Get the current thread's partial aggregate for an engine, and create it if
+ * it doesn't exist yet. The partials of all aggregators live in a single
+ * thread storage, keyed by aggregator ID: a QThreadStorage member would hand
+ * the data of a destroyed aggregator to the next one. Threads only keep weak
+ * references; the aggregator owns its partials.
+ */
+QSharedPointer<QBrowsCapAggregatorPartial> QBrowsCapAggregator::localPartial(const QSharedPointer<QBrowsCapEngine> & engine) {
+    static QThreadStorage<QHash<int, QWeakPointer<QBrowsCapAggregatorPartial> > *> local;
+
+    if (!local.hasLocalData())
+        local.setLocalData(new QHash<int, QWeakPointer<QBrowsCapAggregatorPartial> >());
+    QHash<int, QWeakPointer<QBrowsCapAggregatorPartial> > * threadPartials = local.localData();
+
+    QSharedPointer<QBrowsCapAggregatorPartial> partial = threadPartials->value(this->id).toStrongRef();
+    if (partial.isNull() || partial->engine != engine) {
+        partial = QSharedPointer<QBrowsCapAggregatorPartial>(new QBrowsCapAggregatorPartial());
+        partial->engine = engine;
+
+        // Forget about the partials of aggregators that have been destroyed.
+        QMutableHashIterator<int, QWeakPointer<QBrowsCapAggregatorPartial> > i(*threadPartials);
+        while (i.hasNext()) {
+            if (i.next().value().isNull())
+                i.remove();
+        }
+        threadPartials->insert(this->id, partial.toWeakRef());
+
+        QMutexLocker locker(&this->partialsMutex);
+        this->partials << partial;
+    }
+
+    return partial;
+}
@@ -0,0 +1,74 @@
+#ifndef QBROWSCAPAGGREGATOR_H
+#define QBROWSCAPAGGREGATOR_H
+
+
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QWeakPointer>
+#include <QThreadStorage>
+#include <QAtomicInt>
+#include <QIODevice>
+#include "QBrowsCap.h"
+
+
+// One group of an aggregation: only the fields that were grouped by are set.
+struct QBrowsCapAggregate {
+    QBrowsCapAggregate() : matched(false), count(0) {}
+
+    bool matched;
+    QBrowsCapRecord record;
+    quint64 count;
+};
+
+// The counts of a single thread, keyed by record ID. The engine is kept, so
+// the IDs can still be resolved after the index has been rebuilt.
+struct QBrowsCapAggregatorPartial {
+    QMutex mutex;
+    QSharedPointer<QBrowsCapEngine> engine;
+    QHash<quint32, quint64> counts;
+};
+
+
+/**
+ * Counts user agents by browser, version, platform and/or mobile-ness,
+ * without copying a record per user agent. Each thread that calls add()
+ * accumulates counts per record ID in its own partial aggregate; these are
+ * merged and grouped only when the results are requested. When the index is
+ * rebuilt, counting continues in new partial aggregates.
+ */
+class QBrowsCapAggregator {
+public:
+    enum Field {
+        Platform            = 0x01,
+        BrowserName         = 0x02,
+        BrowserVersion      = 0x04,
+        BrowserVersionMajor = 0x08,
+        BrowserVersionMinor = 0x10,
+        IsMobile            = 0x20
+    };
+    Q_DECLARE_FLAGS(Fields, Field)
+
+    QBrowsCapAggregator(QBrowsCap * browsCap, Fields groupBy);
+
+    void add(const QString & userAgent, quint64 count = 1);
+    quint64 addAll(QIODevice * device);
+
+    QList<QBrowsCapAggregate> getResults();
+    void reset();
+
+protected:
+    QBrowsCap * browsCap;
+    Fields groupBy;
+    int id;
+
+    QMutex partialsMutex;
+    QList<QSharedPointer<QBrowsCapAggregatorPartial> > partials;
+
+    QSharedPointer<QBrowsCapAggregatorPartial> localPartial(const QSharedPointer<QBrowsCapEngine> & engine);
+};
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(QBrowsCapAggregator::Fields)
+
+#endif // QBROWSCAPAGGREGATOR_H
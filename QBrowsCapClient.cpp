@@ -0,0 +1,169 @@
+#include "QBrowsCapClient.h"
+
+QBrowsCapClient::QBrowsCapClient(const QString & serverName) {
+    this->serverName = serverName;
+    this->nextRequestId = 0;
+}
+
+bool QBrowsCapClient::connectToServer(int timeout) {
+    if (this->isConnected())
+        return true;
+
+    this->buffer.clear();
+    this->socket.connectToServer(this->serverName);
+    if (!this->socket.waitForConnected(timeout)) {
+        qCritical("Could not connect to '%s': %s.", qPrintable(this->serverName), qPrintable(this->socket.errorString()));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Match a user agent through qbrowscapd. Behaves like
+ * QBrowsCap::matchUserAgent(); failure to reach the server is reported as an
+ * unidentifiable user agent.
+ */
+QPair<bool, QBrowsCapRecord> QBrowsCapClient::matchUserAgent(const QString & userAgent) {
+    QList<QPair<bool, QBrowsCapRecord> > answers = this->matchUserAgents(QStringList() << userAgent);
+    return answers.first();
+}
+
+/**
+ * Match many user agents at once. They are sent in batches, and all batches
+ * are sent before the first response is read, so that a single round trip
+ * suffices.
+ *
+ * @return
+ *   One answer per user agent, in the same order.
+ */
+QList<QPair<bool, QBrowsCapRecord> > QBrowsCapClient::matchUserAgents(const QStringList & userAgents) {
+    QList<QPair<bool, QBrowsCapRecord> > answers, batchAnswers;
+    QList<quint32> requestIds;
+    bool ok = this->connectToServer();
+
+    for (int i = 0; ok && i < userAgents.size(); i += QBROWSCAP_CLIENT_BATCH_SIZE)
+        requestIds << this->sendRequest(userAgents.mid(i, QBROWSCAP_CLIENT_BATCH_SIZE));
+    this->socket.flush();
+
+    foreach (quint32 requestId, requestIds) {
+        if (!ok || !this->readResponse(requestId, batchAnswers)) {
+            ok = false;
+            break;
+        }
+        answers << batchAnswers;
+    }
+
+    if (!ok) {
+        // Start over with a fresh connection on the next call, responses to
+        // pipelined requests may still be underway.
+        this->socket.abort();
+        answers.clear();
+    }
+
+    // Pad the answers in case of failure: unidentifiable user agents.
+    while (answers.size() < userAgents.size())
+        answers << qMakePair(false, QBrowsCapRecord());
+
+    return answers;
+}
+
+/**
+ * Prefix a payload with its length.
+ */
+QByteArray QBrowsCapClient::frame(const QByteArray & payload) {
+    QByteArray frame;
+    QDataStream out(&frame, QIODevice::WriteOnly);
+    out.setVersion(QBROWSCAP_PROTOCOL_DATASTREAM_VERSION);
+    out << (quint32) payload.size();
+    frame.append(payload);
+    return frame;
+}
+
+/**
+ * Take the first complete frame from a buffer, if any.
+ *
+ * @param ok
+ *   Set to false when the buffer does not contain a valid frame.
+ * @return
+ *   True if a frame was taken, in which case its payload is stored in
+ *   payload.
+ */
+bool QBrowsCapClient::takeFrame(QByteArray & buffer, QByteArray & payload, bool * ok) {
+    quint32 size;
+
+    *ok = true;
+    if (buffer.size() < (int) sizeof(quint32))
+        return false;
+
+    QDataStream in(buffer);
+    in.setVersion(QBROWSCAP_PROTOCOL_DATASTREAM_VERSION);
+    in >> size;
+    if (size > QBROWSCAP_PROTOCOL_MAX_FRAME_SIZE) {
+        *ok = false;
+        return false;
+    }
+    if ((quint32) buffer.size() < sizeof(quint32) + size)
+        return false;
+
+    payload = buffer.mid(sizeof(quint32), size);
+    buffer.remove(0, sizeof(quint32) + size);
+    return true;
+}
+
+/**
+ * Serialize a request.
+ */
+QByteArray QBrowsCapClient::encodeRequest(quint32 requestId, const QStringList & userAgents) {
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    out.setVersion(QBROWSCAP_PROTOCOL_DATASTREAM_VERSION);
+    out << requestId << userAgents;
+    return payload;
+}
+
+/**
+ * Deserialize a request.
+ *
+ * @return
+ *   False if the payload is not a valid request: truncated, or followed by
+ *   trailing data.
+ */
+bool QBrowsCapClient::decodeRequest(const QByteArray & payload, quint32 & requestId, QStringList & userAgents) {
+    QDataStream in(payload);
+    in.setVersion(QBROWSCAP_PROTOCOL_DATASTREAM_VERSION);
+    in >> requestId >> userAgents;
+    return in.status() == QDataStream::Ok && in.atEnd();
+}
+
+quint32 QBrowsCapClient::sendRequest(const QStringList & userAgents) {
+    const quint32 requestId = this->nextRequestId++;
+
+    this->socket.write(QBrowsCapClient::frame(QBrowsCapClient::encodeRequest(requestId, userAgents)));
+
+    return requestId;
+}
+
+bool QBrowsCapClient::readResponse(quint32 requestId, QList<QPair<bool, QBrowsCapRecord> > & answers) {
+    QByteArray payload;
+    quint32 responseId;
+    bool ok;
+
+    while (!QBrowsCapClient::takeFrame(this->buffer, payload, &ok)) {
+        if (!ok || (this->socket.bytesAvailable() == 0 && !this->socket.waitForReadyRead(QBROWSCAP_CLIENT_TIMEOUT))) {
+            qCritical("Could not read a response from '%s': %s.", qPrintable(this->serverName), qPrintable(this->socket.errorString()));
+            return false;
+        }
+        this->buffer.append(this->socket.readAll());
+    }
+
+    QDataStream in(payload);
+    in.setVersion(QBROWSCAP_PROTOCOL_DATASTREAM_VERSION);
+    in >> responseId >> answers;
+    if (in.status() != QDataStream::Ok || responseId != requestId) {
+        qCritical("Received an invalid response from '%s'.", qPrintable(this->serverName));
+        return false;
+    }
+
+    return true;
+}
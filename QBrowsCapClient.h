@@ -0,0 +1,57 @@
+#ifndef QBROWSCAPCLIENT_H
+#define QBROWSCAPCLIENT_H
+
+
+#include <QLocalSocket>
+#include <QByteArray>
+#include <QDataStream>
+#include <QStringList>
+#include <QList>
+#include <QPair>
+#include "QBrowsCap.h"
+
+
+// The protocol spoken between QBrowsCapClient and qbrowscapd over a local
+// socket. Every message is a frame: a quint32 payload length, followed by a
+// payload serialized with QDataStream:
+//   - request:  quint32 request ID, QStringList user agents
+//   - response: quint32 request ID, QList<QPair<bool, QBrowsCapRecord> >
+// Clients may send any number of requests before reading the responses
+// (pipelining); responses are sent in the order of the requests.
+#define QBROWSCAP_DEFAULT_SERVER_NAME "qbrowscapd"
+#define QBROWSCAP_PROTOCOL_DATASTREAM_VERSION QDataStream::Qt_4_6
+#define QBROWSCAP_PROTOCOL_MAX_FRAME_SIZE 16777216
+#define QBROWSCAP_CLIENT_BATCH_SIZE 256
+#define QBROWSCAP_CLIENT_TIMEOUT 5000
+
+
+/**
+ * A thin client for qbrowscapd, which lets multiple processes share one
+ * index and one cache.
+ */
+class QBrowsCapClient {
+public:
+    QBrowsCapClient(const QString & serverName = QBROWSCAP_DEFAULT_SERVER_NAME);
+
+    bool connectToServer(int timeout = QBROWSCAP_CLIENT_TIMEOUT);
+    bool isConnected() const { return this->socket.state() == QLocalSocket::ConnectedState; }
+
+    QPair<bool, QBrowsCapRecord> matchUserAgent(const QString & userAgent);
+    QList<QPair<bool, QBrowsCapRecord> > matchUserAgents(const QStringList & userAgents);
+
+    static QByteArray frame(const QByteArray & payload);
+    static bool takeFrame(QByteArray & buffer, QByteArray & payload, bool * ok);
+    static QByteArray encodeRequest(quint32 requestId, const QStringList & userAgents);
+    static bool decodeRequest(const QByteArray & payload, quint32 & requestId, QStringList & userAgents);
+
+protected:
+    QString serverName;
+    QLocalSocket socket;
+    QByteArray buffer;
+    quint32 nextRequestId;
+
+    quint32 sendRequest(const QStringList & userAgents);
+    bool readResponse(quint32 requestId, QList<QPair<bool, QBrowsCapRecord> > & answers);
+};
+
+#endif // QBROWSCAPCLIENT_H
@@ -0,0 +1,279 @@
+#include "QBrowsCapEngine.h"
+#include "QBrowsCap.h"
+#include <QAtomicInt>
+#include <QFileInfo>
+
+
+//------------------------------------------------------------------------------
+// QBrowsCapEngine.
+
+QBrowsCapEngine::QBrowsCapEngine(const QString & indexFile, int indexVersion) {
+    static QAtomicInt nextId;
+
+    this->indexFile = indexFile;
+    this->indexVersion = indexVersion;
+    this->buildId = 0;
+    this->loaded = false;
+    this->id = nextId.fetchAndAddRelaxed(1);
+
+    this->loadRecords();
+    this->loaded = true;
+}
+
+QBrowsCapEngine::~QBrowsCapEngine() {
+    // The threads that opened these connections also remove them when they
+    // finish; removing a connection twice is harmless.
+    foreach (const QString & connectionName, this->connectionNames)
+        QSqlDatabase::removeDatabase(connectionName);
+}
+
+/**
+ * Whether the index has been rebuilt since this engine was created. Users
+ * should then acquire a new engine.
+ */
+bool QBrowsCapEngine::isRetired() const {
+#if QT_VERSION >= 0x050000
+    return this->retired.loadAcquire() != 0;
+#else
+    return (int) this->retired != 0;
+#endif
+}
+
+/**
+ * Get the current thread's connection to the index, and open it if it
+ * doesn't exist yet. A QSqlDatabase connection may only be used from the
+ * thread that created it.
+ *
+ * An open connection keeps using the index file it opened, also when the
+ * index is rebuilt, but a new one opens the current index file. When another
+ * process has rebuilt it since the records were loaded, the engine is
+ * retired and an invalid connection is returned, so that queries fail
+ * instead of returning record IDs that don't match the loaded records.
+ */
+QSqlDatabase QBrowsCapEngine::database() {
+    // The engine ID keeps connections of engines for different index files,
+    // or for a since rebuilt index, apart.
+    const QString connectionName = QBrowsCapEngine::threadConnectionName(QString("index-%1").arg(this->id));
+
+    if (QSqlDatabase::contains(connectionName))
+        return QSqlDatabase::database(connectionName);
+
+    // Indexes built before build IDs were introduced have build ID 0.
+    int buildId = 0;
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", connectionName);
+        db.setDatabaseName(this->indexFile);
+        if (!db.open())
+            qCritical("Could not open the database: %s.", qPrintable(db.lastError().text()));
+        else {
+            QSqlQuery query(db);
+            query.prepare("SELECT value FROM metadata WHERE name = ?;");
+            query.addBindValue(QBROWSCAP_INDEX_DB_BUILD_ID_PATTERN);
+            if (query.exec() && query.next())
+                buildId = query.value(0).toInt();
+        }
+    }
+
+    if (!this->loaded)
+        this->buildId = buildId;
+    else if (buildId != this->buildId) {
+        QSqlDatabase::removeDatabase(connectionName);
+        QBrowsCapEngineRegistry::retire(this);
+        return QSqlDatabase();
+    }
+
+    QMutexLocker locker(&this->connectionsMutex);
+
+    // Forget about the connections of threads that have finished.
+    QMutableStringListIterator i(this->connectionNames);
+    while (i.hasNext()) {
+        if (!QSqlDatabase::contains(i.next()))
+            i.remove();
+    }
+    this->connectionNames << connectionName;
+
+    return QSqlDatabase::database(connectionName);
+}
+
+/**
+ * Get a name for a connection that only the current thread will use. The
+ * connection is removed when the thread finishes.
+ */
+QString QBrowsCapEngine::threadConnectionName(const QString & purpose) {
+    static QThreadStorage<QBrowsCapThreadConnections *> threadConnections;
+
+    if (!threadConnections.hasLocalData())
+        threadConnections.setLocalData(new QBrowsCapThreadConnections());
+    QBrowsCapThreadConnections * connections = threadConnections.localData();
+
+    const QString connectionName = QString("%1-%2").arg(purpose).arg(connections->token);
+    if (!connections->connectionNames.contains(connectionName))
+        connections->connectionNames << connectionName;
+    return connectionName;
+}
+
+/**
+ * Look up a user agent in the cache.
+ *
+ * @param id
+ *   Set to the record ID if the user agent is cached.
+ * @param timeout
+ *   The maximum time to wait for the cache mutex, in milliseconds, or -1 to
+ *   wait indefinitely.
+ * @return
+ *   True if the user agent is cached.
+ */
+bool QBrowsCapEngine::lookup(const QString & userAgent, quint32 & id, int timeout) {
+    if (!this->cacheMutex.tryLock(timeout))
+        return false;
+
+    QMap<QString, quint32>::const_iterator i = this->cache.constFind(userAgent);
+    const bool found = (i != this->cache.constEnd());
+    if (found)
+        id = i.value();
+    this->cacheMutex.unlock();
+
+    return found;
+}
+
+/**
+ * Cache the answer for a user agent: the ID of the matching record, or 0 if
+ * it could not be identified.
+ */
+void QBrowsCapEngine::insert(const QString & userAgent, quint32 id) {
+    QMutexLocker locker(&this->cacheMutex);
+    this->cache.insert(userAgent, id);
+}
+
+int QBrowsCapEngine::getCacheSize() {
+    QMutexLocker locker(&this->cacheMutex);
+    return this->cache.size();
+}
+
+/**
+ * Empty the cache. Records keep their IDs.
+ */
+void QBrowsCapEngine::resetCache() {
+    QMutexLocker locker(&this->cacheMutex);
+    this->cache.clear();
+}
+
+/**
+ * Load the records table of the index. Record ID 0 is never used by the
+ * index: it means "no match". Opening the connection also loads the ID of
+ * the build of the index that the records belong to.
+ */
+void QBrowsCapEngine::loadRecords() {
+    this->records.resize(1);
+
+    // The index may not have been built yet.
+    if (QFileInfo(this->indexFile).size() <= 1)
+        return;
+
+    QSqlQuery query(this->database());
+    if (!query.exec("SELECT id, platform, \
+                            browser_name, browser_version, \
+                            browser_version_major, browser_version_minor, \
+                            is_mobile \
+                     FROM records \
+                     ORDER BY id"))
+    {
+        qCritical("Could not load the records of '%s': %s.", qPrintable(this->indexFile), qPrintable(query.lastError().text()));
+        return;
+    }
+
+    int id;
+    while (query.next()) {
+        id = query.value(0).toInt();
+        if (id >= this->records.size())
+            this->records.resize(id + 1);
+        this->records[id] = QBrowsCapRecord(query.value(1).toString(),
+                                            query.value(2).toString(),
+                                            query.value(3).toString(),
+                                            query.value(4).toInt(),
+                                            query.value(5).toInt(),
+                                            query.value(6).toBool());
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// QBrowsCapThreadConnections.
+
+QBrowsCapThreadConnections::QBrowsCapThreadConnections() {
+    static QAtomicInt nextToken;
+    this->token = nextToken.fetchAndAddRelaxed(1);
+}
+
+QBrowsCapThreadConnections::~QBrowsCapThreadConnections() {
+    foreach (const QString & connectionName, this->connectionNames)
+        QSqlDatabase::removeDatabase(connectionName);
+}
+
+
+//------------------------------------------------------------------------------
+// QBrowsCapEngineRegistry.
+
+QMutex QBrowsCapEngineRegistry::mutex;
+QHash<QString, QWeakPointer<QBrowsCapEngine> > QBrowsCapEngineRegistry::engines;
+
+/**
+ * Get the engine for an index file and version, creating it if no
+ * QBrowsCap instance is using it yet.
+ */
+QSharedPointer<QBrowsCapEngine> QBrowsCapEngineRegistry::acquire(const QString & indexFile, int indexVersion) {
+    const QString key = QBrowsCapEngineRegistry::key(indexFile, indexVersion);
+    QMutexLocker locker(&QBrowsCapEngineRegistry::mutex);
+
+    QSharedPointer<QBrowsCapEngine> engine = QBrowsCapEngineRegistry::engines.value(key).toStrongRef();
+    if (engine.isNull()) {
+        engine = QSharedPointer<QBrowsCapEngine>(new QBrowsCapEngine(indexFile, indexVersion));
+        QBrowsCapEngineRegistry::engines.insert(key, engine.toWeakRef());
+
+        // Forget about engines that are no longer in use.
+        QMutableHashIterator<QString, QWeakPointer<QBrowsCapEngine> > i(QBrowsCapEngineRegistry::engines);
+        while (i.hasNext()) {
+            if (i.next().value().isNull())
+                i.remove();
+        }
+    }
+
+    return engine;
+}
+
+/**
+ * Stop handing out an engine, because its index file has been rebuilt by
+ * another process, and tell the instances that use it to acquire a new one.
+ */
+void QBrowsCapEngineRegistry::retire(QBrowsCapEngine * engine) {
+    const QString key = QBrowsCapEngineRegistry::key(engine->getIndexFile(), engine->getIndexVersion());
+    QMutexLocker locker(&QBrowsCapEngineRegistry::mutex);
+
+    engine->retire();
+    if (QBrowsCapEngineRegistry::engines.value(key).toStrongRef().data() == engine)
+        QBrowsCapEngineRegistry::engines.remove(key);
+}
+
+/**
+ * Stop handing out the engines for an index file, because it has been
+ * rebuilt, and tell the instances that use them to acquire a new one.
+ */
+void QBrowsCapEngineRegistry::retire(const QString & indexFile) {
+    const QString path = QFileInfo(indexFile).absoluteFilePath();
+    QMutexLocker locker(&QBrowsCapEngineRegistry::mutex);
+
+    QMutableHashIterator<QString, QWeakPointer<QBrowsCapEngine> > i(QBrowsCapEngineRegistry::engines);
+    while (i.hasNext()) {
+        QSharedPointer<QBrowsCapEngine> engine = i.next().value().toStrongRef();
+        if (engine.isNull())
+            i.remove();
+        else if (QFileInfo(engine->getIndexFile()).absoluteFilePath() == path) {
+            engine->retire();
+            i.remove();
+        }
+    }
+}
+
+QString QBrowsCapEngineRegistry::key(const QString & indexFile, int indexVersion) {
+    return QString("%1:%2").arg(QFileInfo(indexFile).absoluteFilePath()).arg(indexVersion);
+}
@@ -0,0 +1,110 @@
+#ifndef QBROWSCAPENGINE_H
+#define QBROWSCAPENGINE_H
+
+
+#include <QHash>
+#include <QMap>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QPair>
+#include <QSharedPointer>
+#include <QWeakPointer>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QStringList>
+#include <QThread>
+#include <QThreadStorage>
+#include <QAtomicInt>
+#include <QVector>
+#include "QBrowsCapRecord.h"
+
+
+/**
+ * A loaded index and its cache, shared by all QBrowsCap instances in this
+ * process that use the same index file and index version. The index itself
+ * is never modified: rebuilding it results in a new engine. The records
+ * table of the index is small, so it is loaded into memory entirely; lookups
+ * only have to query the index for a record ID.
+ */
+class QBrowsCapEngine {
+public:
+    QBrowsCapEngine(const QString & indexFile, int indexVersion);
+    ~QBrowsCapEngine();
+
+    QString getIndexFile() const { return this->indexFile; }
+    int getIndexVersion() const { return this->indexVersion; }
+    int getBuildId() const { return this->buildId; }
+
+    void retire() { this->retired.fetchAndStoreOrdered(1); }
+    bool isRetired() const;
+
+    QSqlDatabase database();
+    static QString threadConnectionName(const QString & purpose);
+
+    bool lookup(const QString & userAgent, quint32 & id, int timeout = -1);
+    void insert(const QString & userAgent, quint32 id);
+    QBrowsCapRecord getRecord(quint32 id) const { return this->records.value(id); }
+
+    int getCacheSize();
+    void resetCache();
+
+protected:
+    QString indexFile;
+    int indexVersion;
+    int buildId;
+    bool loaded;
+    int id;
+    QAtomicInt retired;
+
+    // Every thread gets its own connection to the index.
+    QMutex connectionsMutex;
+    QStringList connectionNames;
+
+    // The records in the index, by ID. ID 0 means: no match. Never modified
+    // after construction, so reading doesn't require a lock.
+    QVector<QBrowsCapRecord> records;
+
+    // The cache maps user agents to record IDs, so that every distinct record
+    // is only stored once.
+    QMutex cacheMutex;
+    QMap<QString, quint32> cache;
+
+    void loadRecords();
+};
+
+
+/**
+ * The connections that a thread has opened. They are removed when the thread
+ * finishes, since a connection may only be used by the thread that created
+ * it. Thread IDs are reused, so connections are named after a token that is
+ * unique to the thread instead.
+ */
+struct QBrowsCapThreadConnections {
+    QBrowsCapThreadConnections();
+    ~QBrowsCapThreadConnections();
+
+    int token;
+    QStringList connectionNames;
+};
+
+
+/**
+ * Hands out engines: instances that ask for the same index file and version
+ * get the same engine. An engine is destroyed when its last user releases
+ * it.
+ */
+class QBrowsCapEngineRegistry {
+public:
+    static QSharedPointer<QBrowsCapEngine> acquire(const QString & indexFile, int indexVersion);
+    static void retire(const QString & indexFile);
+    static void retire(QBrowsCapEngine * engine);
+
+protected:
+    static QString key(const QString & indexFile, int indexVersion);
+
+    static QMutex mutex;
+    static QHash<QString, QWeakPointer<QBrowsCapEngine> > engines;
+};
+
+#endif // QBROWSCAPENGINE_H
@@ -0,0 +1,51 @@
+#ifndef QBROWSCAPRECORD_H
+#define QBROWSCAPRECORD_H
+
+
+#include <QString>
+#include <QDataStream>
+#include <QMetaType>
+#include <QDebug>
+
+
+struct QBrowsCapRecord {
+    QBrowsCapRecord() : browser_version_major(0), browser_version_minor(0), is_mobile(false) {}
+    ~QBrowsCapRecord() {}
+    QBrowsCapRecord(QString platform, QString browser_name,
+                    QString browser_version, quint16 browser_version_major,
+                    quint16 browser_version_minor, bool is_mobile)
+    {
+        this->platform              = platform;
+        this->browser_name          = browser_name;;
+        this->browser_version       = browser_version;
+        this->browser_version_major = browser_version_major;
+        this->browser_version_minor = browser_version_minor;
+        this->is_mobile             = is_mobile;
+    }
+
+    QString platform;
+    QString browser_name;
+    QString browser_version;
+    quint16 browser_version_major;
+    quint16 browser_version_minor;
+    bool    is_mobile;
+};
+
+// Register metatype to allow these types to be streamed in QTests.
+Q_DECLARE_METATYPE(QBrowsCapRecord)
+
+// Allow records to be compared and to be used as QHash keys.
+bool operator==(const QBrowsCapRecord & a, const QBrowsCapRecord & b);
+inline bool operator!=(const QBrowsCapRecord & a, const QBrowsCapRecord & b) { return !(a == b); }
+uint qHash(const QBrowsCapRecord & record);
+
+// QDataStream (de)serialization operators, e.g. for qbrowscapd.
+QDataStream & operator<<(QDataStream & out, const QBrowsCapRecord & record);
+QDataStream & operator>>(QDataStream & in, QBrowsCapRecord & record);
+
+#ifdef DEBUG
+// QDebug() streaming output operators.
+QDebug operator<<(QDebug dbg, const QBrowsCapRecord & record);
+#endif
+
+#endif // QBROWSCAPRECORD_H
@@ -0,0 +1,128 @@
+#include "QBrowsCapShadow.h"
+#include "QBrowsCap.h"
+
+
+//------------------------------------------------------------------------------
+// QBrowsCapReferenceMatcher.
+
+QBrowsCapReferenceMatcher::QBrowsCapReferenceMatcher(const QString & indexFile) {
+    static QAtomicInt nextId;
+
+    this->indexFile = indexFile;
+    this->id = nextId.fetchAndAddRelaxed(1);
+}
+
+QBrowsCapReferenceMatcher::~QBrowsCapReferenceMatcher() {
+    foreach (const QString & connectionName, this->connectionNames)
+        QSqlDatabase::removeDatabase(connectionName);
+}
+
+QSqlDatabase QBrowsCapReferenceMatcher::database() {
+    const QString connectionName = QBrowsCapEngine::threadConnectionName(QString("reference-%1").arg(this->id));
+
+    if (!QSqlDatabase::contains(connectionName)) {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", connectionName);
+        db.setDatabaseName(this->indexFile);
+        if (!db.open())
+            qCritical("Could not open the database: %s.", qPrintable(db.lastError().text()));
+
+        QMutexLocker locker(&this->connectionsMutex);
+
+        // Forget about the connections of threads that have finished.
+        QMutableStringListIterator i(this->connectionNames);
+        while (i.hasNext()) {
+            if (!QSqlDatabase::contains(i.next()))
+                i.remove();
+        }
+        this->connectionNames << connectionName;
+        return db;
+    }
+
+    return QSqlDatabase::database(connectionName);
+}
+
+QPair<bool, QBrowsCapRecord> QBrowsCapReferenceMatcher::matchUserAgent(const QString & userAgent, bool * ok) {
+    QPair<bool, QBrowsCapRecord> answer;
+
+    QSqlQuery query(this->database());
+    query.prepare("SELECT r.platform, \
+                          r.browser_name, r.browser_version, \
+                          r.browser_version_major, r.browser_version_minor, \
+                          r.is_mobile \
+                   FROM browscap b \
+                   INNER JOIN records r ON r.id = b.record_id \
+                   WHERE ? GLOB b.pattern \
+                   ORDER BY LENGTH(b.pattern) \
+                   DESC LIMIT 1");
+    query.addBindValue(userAgent);
+    *ok = query.exec();
+    if (!*ok) {
+        qWarning("Could not query the index: %s.", qPrintable(query.lastError().text()));
+        return answer;
+    }
+    if (query.next()) {
+        answer.first = true;
+        answer.second = QBrowsCapRecord(query.value(0).toString(),
+                                        query.value(1).toString(),
+                                        query.value(2).toString(),
+                                        query.value(3).toInt(),
+                                        query.value(4).toInt(),
+                                        query.value(5).toBool());
+    }
+
+    return answer;
+}
+
+
+//------------------------------------------------------------------------------
+// QBrowsCapShadowReport.
+
+QBrowsCapShadowReport::QBrowsCapShadowReport() {
+    this->samples       = 0;
+    this->agreements    = 0;
+    this->disagreements = 0;
+    this->dropped       = 0;
+    this->errors        = 0;
+    this->primaryLatencies.fill(0, QBROWSCAP_SHADOW_HISTOGRAM_BUCKETS);
+    this->shadowLatencies.fill(0, QBROWSCAP_SHADOW_HISTOGRAM_BUCKETS);
+}
+
+/**
+ * Map a latency to its histogram bucket: bucket i holds latencies in
+ * [2^i, 2^(i+1)) microseconds; bucket 0 also holds latencies below 1 microsecond.
+ */
+int QBrowsCapShadowReport::bucket(qint64 microseconds) {
+    int bucket = 0;
+    while (microseconds > 1 && bucket < QBROWSCAP_SHADOW_HISTOGRAM_BUCKETS - 1) {
+        microseconds >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+
+//------------------------------------------------------------------------------
+// QBrowsCapShadowTask.
+
+QBrowsCapShadowTask::QBrowsCapShadowTask(QBrowsCap * browsCap, QBrowsCapMatcher * matcher,
+                                         const QString & userAgent,
+                                         const QPair<bool, QBrowsCapRecord> & primary,
+                                         qint64 primaryLatency)
+{
+    this->browsCap       = browsCap;
+    this->matcher        = matcher;
+    this->userAgent      = userAgent;
+    this->primary        = primary;
+    this->primaryLatency = primaryLatency;
+}
+
+void QBrowsCapShadowTask::run() {
+    QElapsedTimer timer;
+    bool ok;
+
+    timer.start();
+    QPair<bool, QBrowsCapRecord> shadow = this->matcher->matchUserAgent(this->userAgent, &ok);
+    const qint64 shadowLatency = timer.nsecsElapsed() / 1000;
+
+    this->browsCap->recordShadowResult(this->userAgent, this->primary, this->primaryLatency, shadow, shadowLatency, ok);
+}
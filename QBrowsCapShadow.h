@@ -0,0 +1,115 @@
+#ifndef QBROWSCAPSHADOW_H
+#define QBROWSCAPSHADOW_H
+
+
+#include <QList>
+#include <QPair>
+#include <QRunnable>
+#include <QString>
+#include <QVector>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QThread>
+#include <QMutex>
+#include <QStringList>
+#include "QBrowsCapRecord.h"
+
+
+#define QBROWSCAP_SHADOW_MAX_PENDING 1024
+#define QBROWSCAP_SHADOW_MAX_EXAMPLES 100
+#define QBROWSCAP_SHADOW_HISTOGRAM_BUCKETS 32
+
+
+class QBrowsCap;
+
+
+/**
+ * A matching engine that can be compared against QBrowsCap in shadow mode.
+ * Must be safe to call from a thread other than the one that created it.
+ * Sets ok to false when it fails to come up with an answer, e.g. because of
+ * a database error; such answers are not compared.
+ */
+class QBrowsCapMatcher {
+public:
+    virtual ~QBrowsCapMatcher() {}
+
+    virtual QString getName() const = 0;
+    virtual QPair<bool, QBrowsCapRecord> matchUserAgent(const QString & userAgent, bool * ok) = 0;
+};
+
+
+/**
+ * The reference engine: a single GLOB query over all patterns in the index,
+ * picking the longest matching pattern.
+ */
+class QBrowsCapReferenceMatcher : public QBrowsCapMatcher {
+public:
+    QBrowsCapReferenceMatcher(const QString & indexFile);
+    ~QBrowsCapReferenceMatcher();
+
+    QString getName() const { return "reference"; }
+    QPair<bool, QBrowsCapRecord> matchUserAgent(const QString & userAgent, bool * ok);
+
+protected:
+    QString indexFile;
+    int id;
+
+    // Like QBrowsCap, use one connection per thread.
+    QMutex connectionsMutex;
+    QStringList connectionNames;
+
+    QSqlDatabase database();
+};
+
+
+struct QBrowsCapShadowDisagreement {
+    QString userAgent;
+    QPair<bool, QBrowsCapRecord> primary;
+    QPair<bool, QBrowsCapRecord> shadow;
+};
+
+struct QBrowsCapShadowReport {
+    QBrowsCapShadowReport();
+
+    // Sampled lookups that were compared, lookups that were not sampled
+    // because too many comparisons were pending, and sampled lookups that the
+    // shadow engine failed to answer.
+    quint64 samples;
+    quint64 agreements;
+    quint64 disagreements;
+    quint64 dropped;
+    quint64 errors;
+
+    // The first disagreements.
+    QList<QBrowsCapShadowDisagreement> examples;
+
+    // Latency histograms (log2 of microseconds) of both engines.
+    QVector<quint64> primaryLatencies;
+    QVector<quint64> shadowLatencies;
+
+    static int bucket(qint64 microseconds);
+};
+
+
+/**
+ * Runs a sampled lookup through the shadow engine and reports the outcome
+ * to QBrowsCap.
+ */
+class QBrowsCapShadowTask : public QRunnable {
+public:
+    QBrowsCapShadowTask(QBrowsCap * browsCap, QBrowsCapMatcher * matcher,
+                        const QString & userAgent,
+                        const QPair<bool, QBrowsCapRecord> & primary,
+                        qint64 primaryLatency);
+    void run();
+
+protected:
+    QBrowsCap * browsCap;
+    QBrowsCapMatcher * matcher;
+    QString userAgent;
+    QPair<bool, QBrowsCapRecord> primary;
+    qint64 primaryLatency;
+};
+
+#endif // QBROWSCAPSHADOW_H
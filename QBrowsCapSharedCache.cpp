@@ -0,0 +1,245 @@
+#include "QBrowsCapSharedCache.h"
+#include "QBrowsCap.h"
+#ifdef Q_CC_MSVC
+#include <intrin.h>
+#endif
+
+/**
+ * Keep the reads before this point from being reordered with those after it.
+ */
+static inline void readBarrier() {
+#ifdef Q_CC_MSVC
+    // MSVC targets x86, where loads are not reordered with other loads.
+    _ReadWriteBarrier();
+#else
+    __sync_synchronize();
+#endif
+}
+
+/**
+ * Read the sequence of a slot. This must not write to the slot (as an atomic
+ * read-modify-write would), or every lookup would move the slot's cache line
+ * between the CPUs of all processes that read it.
+ */
+static inline int readSequence(QBasicAtomicInt & sequence) {
+#if QT_VERSION >= 0x050000
+    return sequence.loadAcquire();
+#else
+    // Qt 4 has no acquire load; a volatile read plus a barrier will do.
+    const int value = sequence;
+    readBarrier();
+    return value;
+#endif
+}
+
+QBrowsCapSharedCache::QBrowsCapSharedCache() {
+    this->header = NULL;
+    this->table = NULL;
+    this->buildId = -1;
+}
+
+/**
+ * Attach to the shared cache for the given index file, or create it if no
+ * other process has done so yet.
+ *
+ * @param indexFile
+ *   The index file. All processes using the same index file share a cache.
+ * @param buildId
+ *   The build ID of the index, which increases every time the index is
+ *   built, also when it is rebuilt from the same browscap.csv version (e.g.
+ *   with other options). When it is newer than the build the cached answers
+ *   were computed with, the cache is cleared. Processes that use another
+ *   build will then neither read nor write the cache (until they rebind()),
+ *   since the record IDs in it don't refer to the records of their index.
+ * @param numSlots
+ *   The number of slots, rounded up to a power of two. Ignored when the
+ *   shared cache already exists.
+ * @return
+ *   True if the shared cache could be attached to.
+ */
+bool QBrowsCapSharedCache::attach(const QString & indexFile, int buildId, int numSlots) {
+    this->detach();
+
+    // Round up to a power of two, so we can mask instead of divide.
+    quint32 n = 1;
+    while (n < (quint32) qMax(numSlots, QBROWSCAP_SHARED_CACHE_MAX_PROBES))
+        n <<= 1;
+
+    const QByteArray path = QFileInfo(indexFile).absoluteFilePath().toUtf8();
+    // Record IDs are only meaningful for one index schema, so processes
+    // that use a different schema get a different cache.
+    this->memory.setKey(QString("QBrowsCap-%1-").arg(QBROWSCAP_INDEX_DB_SCHEMA_VERSION)
+                        + QCryptographicHash::hash(path, QCryptographicHash::Md5).toHex());
+
+    if (!this->memory.attach()) {
+        if (!this->memory.create(sizeof(QBrowsCapSharedCacheHeader) + n * sizeof(QBrowsCapSharedCacheSlot))
+            && !(this->memory.error() == QSharedMemory::AlreadyExists && this->memory.attach()))
+        {
+            qCritical("Could not attach to the shared cache: %s.", qPrintable(this->memory.errorString()));
+            return false;
+        }
+    }
+
+    this->memory.lock();
+    this->header = (QBrowsCapSharedCacheHeader *) this->memory.data();
+    this->table = (QBrowsCapSharedCacheSlot *) ((char *) this->memory.data() + sizeof(QBrowsCapSharedCacheHeader));
+    if (this->header->magic != QBROWSCAP_SHARED_CACHE_MAGIC) {
+        // The shared memory region was just created: initialize it. Its size
+        // may have been rounded up, so derive the number of slots from it.
+        n = 1;
+        while (n * 2 * sizeof(QBrowsCapSharedCacheSlot) <= this->memory.size() - sizeof(QBrowsCapSharedCacheHeader))
+            n <<= 1;
+        this->header->numSlots = n;
+        this->header->buildId = buildId;
+        this->clear();
+        this->header->magic = QBROWSCAP_SHARED_CACHE_MAGIC;
+    }
+    else if (this->header->buildId < buildId) {
+        // The cached answers were computed with an older build of the index.
+        this->clear();
+        this->header->buildId = buildId;
+    }
+    this->memory.unlock();
+
+    this->buildId = buildId;
+
+    return true;
+}
+
+void QBrowsCapSharedCache::detach() {
+    if (this->memory.isAttached())
+        this->memory.detach();
+    this->header = NULL;
+    this->table = NULL;
+    this->buildId = -1;
+}
+
+/**
+ * Switch to another build of the index without reattaching, which is safe
+ * while lookups are in progress. When no process uses the cache for a newer
+ * build yet, the cache is cleared.
+ *
+ * @return
+ *   True if the cache is now used for the given build.
+ */
+bool QBrowsCapSharedCache::rebind(int buildId) {
+    if (this->header == NULL)
+        return false;
+
+    this->memory.lock();
+    if (this->header->buildId < buildId) {
+        this->clear();
+        this->header->buildId = buildId;
+    }
+    if (this->header->buildId == buildId)
+        this->buildId = buildId;
+    this->memory.unlock();
+
+    return this->buildId == buildId;
+}
+
+/**
+ * Look up the answer for a user agent.
+ *
+ * @param recordId
+ *   Set to the ID of the matching record in the index, or 0 if the user
+ *   agent could not be identified.
+ * @return
+ *   True if the answer was found.
+ */
+bool QBrowsCapSharedCache::lookup(const QString & userAgent, quint32 & recordId) const {
+    if (this->header == NULL || this->header->buildId != this->buildId)
+        return false;
+
+    const quint64 h = QBrowsCapSharedCache::hash(userAgent);
+    const quint32 mask = this->header->numSlots - 1;
+    quint64 slotHash;
+    quint32 slotRecordId;
+    int before, after;
+
+    for (quint32 i = 0; i < QBROWSCAP_SHARED_CACHE_MAX_PROBES; i++) {
+        QBrowsCapSharedCacheSlot * slot = &this->table[(h + i) & mask];
+
+        before = readSequence(slot->sequence);
+        if (before & 1)
+            return false; // Being written, treat as a miss.
+        // Copy the fields one by one: the sequence makes the slot
+        // non-trivially copyable.
+        slotHash = slot->hash;
+        slotRecordId = slot->recordId;
+        // The copy must be complete before the sequence is read again.
+        readBarrier();
+        after = readSequence(slot->sequence);
+        if (before != after)
+            return false; // Overwritten while reading, treat as a miss.
+
+        if (slotHash == 0)
+            return false;
+        else if (slotHash != h)
+            continue;
+
+        recordId = slotRecordId;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Store the answer for a user agent: the ID of the matching record in the
+ * index, or 0 if it could not be identified.
+ */
+void QBrowsCapSharedCache::insert(const QString & userAgent, quint32 recordId) {
+    if (this->header == NULL || this->header->buildId != this->buildId)
+        return;
+
+    const quint64 h = QBrowsCapSharedCache::hash(userAgent);
+
+    this->memory.lock();
+
+    // Use the first empty slot or the slot that already holds this user
+    // agent. If there is none, evict one of the probed slots.
+    const quint32 mask = this->header->numSlots - 1;
+    QBrowsCapSharedCacheSlot * slot = NULL;
+    for (quint32 i = 0; i < QBROWSCAP_SHARED_CACHE_MAX_PROBES; i++) {
+        QBrowsCapSharedCacheSlot * candidate = &this->table[(h + i) & mask];
+        if (candidate->hash == 0 || candidate->hash == h) {
+            slot = candidate;
+            break;
+        }
+    }
+    if (slot == NULL)
+        slot = &this->table[(h + (h >> 32) % QBROWSCAP_SHARED_CACHE_MAX_PROBES) & mask];
+
+    slot->sequence.fetchAndAddOrdered(1);
+    slot->hash     = h;
+    slot->recordId = recordId;
+    slot->sequence.fetchAndAddOrdered(1);
+
+    this->memory.unlock();
+}
+
+/**
+ * 64-bit FNV-1a hash of a user agent. Never returns 0, since that marks an
+ * empty slot.
+ */
+quint64 QBrowsCapSharedCache::hash(const QString & userAgent) {
+    quint64 h = Q_UINT64_C(14695981039346656037);
+    const ushort * c = userAgent.utf16();
+    for (int i = 0; i < userAgent.length(); i++) {
+        h ^= c[i];
+        h *= Q_UINT64_C(1099511628211);
+    }
+    return (h != 0) ? h : 1;
+}
+
+/**
+ * Empty all slots. Must be called while holding the QSharedMemory lock.
+ */
+void QBrowsCapSharedCache::clear() {
+    for (quint32 i = 0; i < this->header->numSlots; i++) {
+        this->table[i].sequence.fetchAndAddOrdered(1);
+        this->table[i].hash = 0;
+        this->table[i].sequence.fetchAndAddOrdered(1);
+    }
+}
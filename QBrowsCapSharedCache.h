@@ -0,0 +1,72 @@
+#ifndef QBROWSCAPSHAREDCACHE_H
+#define QBROWSCAPSHAREDCACHE_H
+
+
+#include <QSharedMemory>
+#include <QCryptographicHash>
+#include <QFileInfo>
+#include <QAtomicInt>
+#include <QString>
+
+
+#define QBROWSCAP_SHARED_CACHE_MAGIC 0x51424332 // "QBC2"
+#define QBROWSCAP_SHARED_CACHE_DEFAULT_SLOTS 65536
+#define QBROWSCAP_SHARED_CACHE_MAX_PROBES 8
+
+
+// The layout of the shared memory region: a header, followed by the slots of
+// an open-addressing hash table. Only POD types may be used here, since the
+// region is mapped into multiple processes.
+struct QBrowsCapSharedCacheHeader {
+    quint32 magic;
+    qint32  buildId;
+    quint32 numSlots;
+    quint32 padding;
+};
+
+struct QBrowsCapSharedCacheSlot {
+    // Odd while the slot is being written. Readers retry (i.e. miss) when the
+    // sequence is odd or has changed while they were reading the slot.
+    QBasicAtomicInt sequence;
+    // The ID of the matching record in the index; 0 means: no match.
+    quint32 recordId;
+    // The hash of the user agent; 0 means the slot is empty.
+    quint64 hash;
+};
+
+
+/**
+ * A cache of matchUserAgent() answers that is shared by all processes that
+ * use the same index file. Lookups are lock-free; insertions are serialized
+ * through the QSharedMemory lock. The number of slots is fixed, so the
+ * memory usage per host is bounded: when all probed slots are taken, an
+ * existing entry is overwritten.
+ */
+class QBrowsCapSharedCache {
+public:
+    QBrowsCapSharedCache();
+
+    bool attach(const QString & indexFile, int buildId, int numSlots = QBROWSCAP_SHARED_CACHE_DEFAULT_SLOTS);
+    void detach();
+    bool rebind(int buildId);
+    bool isAttached() const { return this->header != NULL; }
+
+    int getNumSlots() const { return (this->header != NULL) ? this->header->numSlots : 0; }
+    int getBuildId() const { return this->buildId; }
+    int getSharedBuildId() const { return (this->header != NULL) ? this->header->buildId : -1; }
+
+    bool lookup(const QString & userAgent, quint32 & recordId) const;
+    void insert(const QString & userAgent, quint32 recordId);
+
+    static quint64 hash(const QString & userAgent);
+
+protected:
+    QSharedMemory memory;
+    QBrowsCapSharedCacheHeader * header;
+    QBrowsCapSharedCacheSlot * table;
+    int buildId;
+
+    void clear();
+};
+
+#endif // QBROWSCAPSHAREDCACHE_H
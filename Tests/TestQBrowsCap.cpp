@@ -128,3 +128,310 @@ void TestQBrowsCap::matchUserAgent() {
         QTEST(details.is_mobile, "is_mobile");
     }
 }
+
+void TestQBrowsCap::sharedCache() {
+    const QString userAgent = "Mozilla/5.0 (Windows; U; Windows NT 6.1; en-US; rv:1.9.2.10) Gecko/20100914 Firefox/3.6.10";
+
+    QBrowsCap other(QDir::currentPath() + "/browscap.csv", tmp.fileName());
+    QVERIFY2(other.enableSharedCache(1024) == true, "The shared cache could not be created.");
+    QVERIFY2(this->browsCap.enableSharedCache(1024) == true, "The shared cache could not be attached to.");
+
+    // The first lookup fills the shared cache, the second one is answered by
+    // it.
+    QPair<bool, QBrowsCapRecord> first = other.matchUserAgent(userAgent);
+    QBrowsCapSharedCache cache;
+    QVERIFY2(cache.attach(tmp.fileName(), this->browsCap.getIndexBuildId(), 1024) == true, "The shared cache could not be attached to.");
+    quint32 id = 0;
+    QVERIFY(cache.lookup(userAgent, id) == true);
+    QVERIFY(id != 0);
+    QVERIFY(cache.lookup(userAgent + " (uncached)", id) == false);
+    QPair<bool, QBrowsCapRecord> second = this->browsCap.matchUserAgent(userAgent);
+    this->browsCap.disableSharedCache();
+
+    QVERIFY(first.first == true && second.first == true);
+    QCOMPARE(second.second.platform, first.second.platform);
+    QCOMPARE(second.second.browser_name, first.second.browser_name);
+    QCOMPARE(second.second.browser_version, first.second.browser_version);
+    QCOMPARE(second.second.browser_version_major, first.second.browser_version_major);
+    QCOMPARE(second.second.browser_version_minor, first.second.browser_version_minor);
+    QCOMPARE(second.second.is_mobile, first.second.is_mobile);
+
+    // Rebuilding the index, even from the same version, clears the shared
+    // cache: the record IDs in it may no longer be valid.
+    const int buildId = this->browsCap.getIndexBuildId();
+    QVERIFY2(other.buildIndex(true) == true, "The index could not be rebuilt.");
+    QVERIFY(this->browsCap.getIndexBuildId() != buildId);
+    QVERIFY(cache.lookup(userAgent, id) == false);
+    // Processes that didn't rebuild the index follow once they use the new
+    // build, but never switch back to an older one.
+    QVERIFY(cache.rebind(buildId) == false);
+    QVERIFY(cache.rebind(this->browsCap.getIndexBuildId()) == true);
+    QVERIFY(cache.lookup(userAgent, id) == false);
+    other.matchUserAgent(userAgent);
+    QVERIFY(cache.lookup(userAgent, id) == true);
+}
+
+void TestQBrowsCap::aggregate() {
+    QBrowsCapAggregator aggregator(&this->browsCap, QBrowsCapAggregator::BrowserName | QBrowsCapAggregator::IsMobile);
+
+    // Two different Chrome versions, one Firefox, one iPhone and one unknown.
+    aggregator.add("Mozilla/5.0 (Macintosh; U; Intel Mac OS X 10_6_5; en-US) AppleWebKit/534.10 (KHTML, like Gecko) Chrome/8.0.552.231 Safari/534.10");
+    aggregator.add("Mozilla/5.0 (Windows; U; Windows NT 6.1; en-US) AppleWebKit/534.3 (KHTML, like Gecko) Chrome/6.0.472.63 Safari/534.3", 2);
+    aggregator.add("Mozilla/5.0 (Windows; U; Windows NT 6.1; en-US; rv:1.9.2.10) Gecko/20100914 Firefox/3.6.10");
+    aggregator.add("Mozilla/5.0 (iPhone; U; CPU iPhone OS 4_2_1 like Mac OS X; en-us) AppleWebKit/533.17.9 (KHTML, like Gecko) Version/5.0.2 Mobile/8C148a Safari/6533.18.5");
+    aggregator.add("Mozilla/5.0 (Macintosh; U; Intel Mac OS X 10_6_5; en-US) AppleWebKit/534.10 (KHTML, like Gecko) NON/10.0");
+
+    QMap<QString, quint64> counts;
+    foreach (const QBrowsCapAggregate & aggregate, aggregator.getResults()) {
+        // Fields that were not grouped by are not set.
+        QVERIFY(aggregate.record.platform.isEmpty());
+        QVERIFY(aggregate.record.browser_version.isEmpty());
+
+        if (aggregate.matched)
+            counts.insert(aggregate.record.browser_name + (aggregate.record.is_mobile ? " (mobile)" : ""), aggregate.count);
+        else
+            counts.insert("unknown", aggregate.count);
+    }
+
+    QCOMPARE(counts.size(), 4);
+    QCOMPARE(counts.value("Chrome"), (quint64) 3);
+    QCOMPARE(counts.value("Firefox"), (quint64) 1);
+    QCOMPARE(counts.value("iPhone (mobile)"), (quint64) 1);
+    QCOMPARE(counts.value("unknown"), (quint64) 1);
+
+    // A new aggregator on the same thread starts from scratch, and doesn't
+    // lose its own counts to those of a destroyed one.
+    {
+        QBrowsCapAggregator previous(&this->browsCap, QBrowsCapAggregator::BrowserName);
+        previous.add("Mozilla/5.0 (Windows; U; Windows NT 6.1; en-US; rv:1.9.2.10) Gecko/20100914 Firefox/3.6.10");
+    }
+    QBrowsCapAggregator next(&this->browsCap, QBrowsCapAggregator::BrowserName);
+    next.add("Mozilla/5.0 (Windows; U; Windows NT 6.1; en-US; rv:1.9.2.10) Gecko/20100914 Firefox/3.6.10", 2);
+    QList<QBrowsCapAggregate> results = next.getResults();
+    QCOMPARE(results.size(), 1);
+    QCOMPARE(results[0].record.browser_name, QString("Firefox"));
+    QCOMPARE(results[0].count, (quint64) 2);
+}
+
+void TestQBrowsCap::hotTier() {
+    QStringList userAgents;
+    userAgents << "Mozilla/5.0 (Macintosh; U; Intel Mac OS X 10_6_5; en-US) AppleWebKit/534.10 (KHTML, like Gecko) Chrome/8.0.552.231 Safari/534.10"
+               << "Mozilla/4.0 (compatible; MSIE 8.0; Windows NT 5.1; Trident/4.0; WinTSI 05.11.2009)"
+               << "Mozilla/5.0 (Windows; U; Windows NT 6.1; en-US; rv:1.9.2.10) Gecko/20100914 Firefox/3.6.10"
+               << "Mozilla/5.0 (iPhone; U; CPU iPhone OS 4_2_1 like Mac OS X; en-us) AppleWebKit/533.17.9 (KHTML, like Gecko) Version/5.0.2 Mobile/8C148a Safari/6533.18.5"
+               << "Mozilla/5.0 (Macintosh; U; Intel Mac OS X 10_6_5; en-US) AppleWebKit/534.10 (KHTML, like Gecko) NON/10.0";
+
+    // Profile a few user agents, then rebuild the index with a hot tier.
+    QList<QPair<bool, QBrowsCapRecord> > before;
+    this->browsCap.resetCache();
+    this->browsCap.setProfilingEnabled(true);
+    foreach (const QString & userAgent, userAgents)
+        before << this->browsCap.matchUserAgent(userAgent);
+    // Lookups that are answered by the cache count too.
+    foreach (const QString & userAgent, userAgents)
+        this->browsCap.matchUserAgent(userAgent);
+    this->browsCap.setProfilingEnabled(false);
+    QVERIFY2(this->browsCap.saveProfile() == true, "The profile could not be saved.");
+
+    QFile profile(this->browsCap.getProfileFile());
+    QVERIFY(profile.open(QIODevice::ReadOnly | QIODevice::Text));
+    quint64 hits = 0;
+    while (!profile.atEnd())
+        hits += QString(profile.readLine()).section('\t', 0, 0).toULongLong();
+    profile.close();
+    QCOMPARE(hits, (quint64) 2 * (userAgents.size() - 1)); // The last one is unknown.
+
+    QVERIFY2(this->browsCap.buildIndex(true) == true, "The index could not be rebuilt.");
+    QFile::remove(this->browsCap.getProfileFile());
+
+    // The hot tier must not change any answer, neither for the profiled user
+    // agents nor according to the reference engine.
+    QBrowsCapReferenceMatcher reference(tmp.fileName());
+    this->browsCap.resetCache();
+    this->browsCap.resetShadowReport();
+    this->browsCap.setShadowMatcher(&reference, 1.0);
+    for (int i = 0; i < userAgents.size(); i++) {
+        QPair<bool, QBrowsCapRecord> after = this->browsCap.matchUserAgent(userAgents[i]);
+        QCOMPARE(after.first, before[i].first);
+        QVERIFY(after.second == before[i].second);
+    }
+
+    // A longer pattern in the full index must still win over a hot one.
+    QPair<bool, QBrowsCapRecord> palemoon = this->browsCap.matchUserAgent("Mozilla/5.0 (Windows; U; Windows NT 6.1; en-US; rv:1.9.2.3) Gecko/20100403 Firefox/3.6.3 (Palemoon/3.6.3)");
+    QVERIFY(palemoon.first == true);
+    QCOMPARE(palemoon.second.browser_name, QString("PaleMoon"));
+
+    this->browsCap.waitForShadowLookups();
+    this->browsCap.setShadowMatcher(NULL);
+    QCOMPARE(this->browsCap.getShadowReport().disagreements, (quint64) 0);
+}
+
+void TestQBrowsCap::matchUserAgentWithinBudget() {
+    const QString userAgent = "Mozilla/5.0 (Windows; U; Windows NT 5.1; en-US; rv:1.7.5) Gecko/20060127 Netscape/8.1";
+    const QString hotUserAgent = "Mozilla/5.0 (Windows; U; Windows NT 6.1; en-US; rv:1.9.2.10) Gecko/20100914 Firefox/3.6.10";
+    QPair<bool, QBrowsCapRecord> result;
+    QSemaphore release;
+    bool degraded;
+
+    // Keep the background lookups from finishing in time.
+    QThreadPool * pool = this->browsCap.getLookupPool();
+    const int maxThreadCount = pool->maxThreadCount();
+    pool->setMaxThreadCount(1);
+    pool->start(new BlockingTask(&release));
+
+    // An uncached user agent that isn't in the hot tier (built by the hotTier
+    // test) can't be identified in time.
+    this->browsCap.resetCache();
+    result = this->browsCap.matchUserAgent(userAgent, 50, &degraded);
+    QVERIFY(degraded == true);
+    QVERIFY(result.first == false);
+
+    // For one that is in the hot tier, the hot match is the best effort.
+    result = this->browsCap.matchUserAgent(hotUserAgent, 50, &degraded);
+    QVERIFY(degraded == true);
+    QVERIFY(result.first == true);
+    QCOMPARE(result.second.browser_name, QString("Firefox"));
+
+    // Without any budget, not even the hot tier is queried.
+    result = this->browsCap.matchUserAgent(hotUserAgent, 0, &degraded);
+    QVERIFY(degraded == true);
+    QVERIFY(result.first == false);
+
+    // Once the background lookup can run, it completes.
+    release.release();
+    result = this->browsCap.matchUserAgent(userAgent, 5000, &degraded);
+    QVERIFY(degraded == false);
+    QVERIFY(result.first == true);
+    QCOMPARE(result.second.browser_name, QString("Netscape"));
+    pool->waitForDone();
+    pool->setMaxThreadCount(maxThreadCount);
+
+    // Now it is cached.
+    result = this->browsCap.matchUserAgent(userAgent, 0, &degraded);
+    QVERIFY(degraded == false);
+    QCOMPARE(result.second.browser_version, QString("8.1"));
+}
+
+void TestQBrowsCap::shadowMode() {
+    QStringList userAgents;
+    userAgents << "Mozilla/5.0 (Macintosh; U; Intel Mac OS X 10_6_5; en-US) AppleWebKit/534.10 (KHTML, like Gecko) Chrome/8.0.552.231 Safari/534.10"
+               << "Mozilla/4.0 (compatible; MSIE 8.0; Windows NT 5.1; Trident/4.0; WinTSI 05.11.2009)"
+               << "Mozilla/5.0 (Macintosh; U; Intel Mac OS X 10.6; en-US; rv:1.9.1.13) Gecko/20100914 Firefox/3.5.13"
+               << "Mozilla/5.0 (Macintosh; U; Intel Mac OS X 10_6_5; en-US) AppleWebKit/534.10 (KHTML, like Gecko) NON/10.0";
+
+    // The tiered index lookups must agree with the reference query.
+    QBrowsCapReferenceMatcher reference(tmp.fileName());
+    this->browsCap.resetCache();
+    this->browsCap.resetShadowReport();
+    this->browsCap.setShadowMatcher(&reference, 1.0);
+    foreach (const QString & userAgent, userAgents)
+        this->browsCap.matchUserAgent(userAgent);
+    this->browsCap.waitForShadowLookups();
+    this->browsCap.setShadowMatcher(NULL);
+
+    QBrowsCapShadowReport report = this->browsCap.getShadowReport();
+    QCOMPARE(report.samples, (quint64) userAgents.size());
+    QCOMPARE(report.agreements, (quint64) userAgents.size());
+    QCOMPARE(report.disagreements, (quint64) 0);
+    QCOMPARE(report.errors, (quint64) 0);
+    QVERIFY(report.examples.isEmpty());
+
+    quint64 numLatencies = 0;
+    foreach (quint64 count, report.shadowLatencies)
+        numLatencies += count;
+    QCOMPARE(numLatencies, (quint64) userAgents.size());
+
+    // A shadow engine that fails to answer doesn't disagree.
+    QTemporaryFile empty;
+    QVERIFY2(empty.open() == true, "A temporary file could not be created.");
+    QBrowsCapReferenceMatcher broken(empty.fileName());
+    this->browsCap.resetCache();
+    this->browsCap.resetShadowReport();
+    this->browsCap.setShadowMatcher(&broken, 1.0);
+    this->browsCap.matchUserAgent(userAgents.first());
+    this->browsCap.waitForShadowLookups();
+    this->browsCap.setShadowMatcher(NULL);
+
+    report = this->browsCap.getShadowReport();
+    QCOMPARE(report.errors, (quint64) 1);
+    QCOMPARE(report.samples, (quint64) 0);
+    QCOMPARE(report.disagreements, (quint64) 0);
+}
+
+void TestQBrowsCap::sharedEngine() {
+    QBrowsCap other(QDir::currentPath() + "/browscap.csv", tmp.fileName());
+
+    // Instances that use the same index share one cache.
+    this->browsCap.resetCache();
+    QCOMPARE(this->browsCap.getCacheSize(), 0);
+    other.matchUserAgent("Mozilla/5.0 (Windows; U; Windows NT 6.1; en-US) AppleWebKit/534.3 (KHTML, like Gecko) Chrome/6.0.472.63 Safari/534.3");
+    QCOMPARE(this->browsCap.getCacheSize(), 1);
+
+    // An instance that uses a different index file doesn't.
+    QTemporaryFile otherIndex;
+    QVERIFY2(otherIndex.open() == true, "A temporary file could not be created.");
+    other.setIndexFile(otherIndex.fileName());
+    QVERIFY2(other.buildIndex() == true, "The index could not be built.");
+    QCOMPARE(other.getCacheSize(), 0);
+    QCOMPARE(this->browsCap.getCacheSize(), 1);
+
+    // When another instance rebuilds the index, this one switches to it.
+    QBrowsCap rebuilder(QDir::currentPath() + "/browscap.csv", tmp.fileName());
+    QVERIFY2(rebuilder.buildIndex(true) == true, "The index could not be rebuilt.");
+    QCOMPARE(this->browsCap.getCacheSize(), 0);
+    QVERIFY(this->browsCap.matchUserAgent("Mozilla/5.0 (Windows; U; Windows NT 6.1; en-US) AppleWebKit/534.3 (KHTML, like Gecko) Chrome/6.0.472.63 Safari/534.3").first == true);
+}
+
+void TestQBrowsCap::recordIds() {
+    QCOMPARE(this->browsCap.getIndexSchemaVersion(), QBROWSCAP_INDEX_DB_SCHEMA_VERSION);
+
+    // Equal answers have equal record IDs, also when they aren't cached.
+    this->browsCap.resetCache();
+    quint32 firefox = this->browsCap.matchUserAgentId("Mozilla/5.0 (Windows; U; Windows NT 6.1; en-US; rv:1.9.2.10) Gecko/20100914 Firefox/3.6.10");
+    this->browsCap.resetCache();
+    quint32 firefoxGB = this->browsCap.matchUserAgentId("Mozilla/5.0 (Windows; U; Windows NT 6.1; en-GB; rv:1.9.2.10) Gecko/20100914 Firefox/3.6.10");
+    quint32 chrome = this->browsCap.matchUserAgentId("Mozilla/5.0 (Windows; U; Windows NT 6.1; en-US) AppleWebKit/534.3 (KHTML, like Gecko) Chrome/6.0.472.63 Safari/534.3");
+    quint32 unknown = this->browsCap.matchUserAgentId("Mozilla/5.0 (Macintosh; U; Intel Mac OS X 10_6_5; en-US) AppleWebKit/534.10 (KHTML, like Gecko) NON/10.0");
+    QVERIFY(firefox != 0);
+    QCOMPARE(firefoxGB, firefox);
+    QVERIFY(chrome != 0 && chrome != firefox);
+    QCOMPARE(unknown, (quint32) 0);
+
+    // The records come from the index.
+    QCOMPARE(this->browsCap.getRecord(firefox).browser_name, QString("Firefox"));
+    QCOMPARE(this->browsCap.getRecord(chrome).browser_name, QString("Chrome"));
+}
+
+void TestQBrowsCap::protocolFrames() {
+    QStringList userAgents, decoded;
+    userAgents << "Mozilla/5.0" << "Opera/9.80";
+    QByteArray payload = QBrowsCapClient::encodeRequest(42, userAgents);
+    QByteArray buffer, taken;
+    quint32 requestId;
+    bool ok;
+
+    // Pipelined frames are taken one by one; an incomplete frame waits for
+    // more data.
+    buffer = QBrowsCapClient::frame(payload) + QBrowsCapClient::frame(payload);
+    buffer.chop(1);
+    QVERIFY(QBrowsCapClient::takeFrame(buffer, taken, &ok) == true && ok);
+    QCOMPARE(taken, payload);
+    QVERIFY(QBrowsCapClient::takeFrame(buffer, taken, &ok) == false && ok);
+    QCOMPARE(buffer.size(), (int) sizeof(quint32) + payload.size() - 1);
+
+    QVERIFY(QBrowsCapClient::decodeRequest(payload, requestId, decoded) == true);
+    QCOMPARE(requestId, (quint32) 42);
+    QCOMPARE(decoded, userAgents);
+
+    // Oversized frames are rejected before they have been received.
+    buffer.clear();
+    QDataStream out(&buffer, QIODevice::WriteOnly);
+    out << (quint32) (QBROWSCAP_PROTOCOL_MAX_FRAME_SIZE + 1);
+    QVERIFY(QBrowsCapClient::takeFrame(buffer, taken, &ok) == false);
+    QVERIFY(ok == false);
+
+    // Corrupt requests: truncated, or followed by trailing data.
+    QVERIFY(QBrowsCapClient::decodeRequest(payload.left(payload.size() - 1), requestId, decoded) == false);
+    QVERIFY(QBrowsCapClient::decodeRequest(payload + "x", requestId, decoded) == false);
+    QVERIFY(QBrowsCapClient::decodeRequest(QByteArray("xy"), requestId, decoded) == false);
+}
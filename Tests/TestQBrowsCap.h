@@ -7,10 +7,29 @@
 #include <QTemporaryFile>
 #include <QDebug>
 #include <QTime>
+#include <QSemaphore>
 #include "../QBrowsCap.h"
+#include "../QBrowsCapAggregator.h"
+#include "../QBrowsCapClient.h"
 
 #define TESTQBROWSCAP_CSV_VERSION 4594
 
+// Exposes the pool that finishes lookups that ran out of time.
+class TestableQBrowsCap : public QBrowsCap {
+public:
+    QThreadPool * getLookupPool() { return &this->lookupPool; }
+};
+
+// Occupies a thread pool's thread until released.
+class BlockingTask : public QRunnable {
+public:
+    BlockingTask(QSemaphore * release) : release(release) {}
+    void run() { this->release->acquire(); }
+
+protected:
+    QSemaphore * release;
+};
+
 class TestQBrowsCap: public QObject {
     Q_OBJECT
 
@@ -21,9 +40,17 @@ private slots:
     void indexIsUpToDate();
     void matchUserAgent();
     void matchUserAgent_data();
+    void sharedCache();
+    void aggregate();
+    void hotTier();
+    void matchUserAgentWithinBudget();
+    void shadowMode();
+    void sharedEngine();
+    void recordIds();
+    void protocolFrames();
 
 private:
-    QBrowsCap browsCap;
+    TestableQBrowsCap browsCap;
     QTemporaryFile tmp;
 };
 
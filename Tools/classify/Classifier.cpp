@@ -0,0 +1,281 @@
+#include "Classifier.h"
+
+
+//------------------------------------------------------------------------------
+// Helper functions.
+
+static void appendQuoted(QByteArray & out, const QString & value) {
+    out.append('"');
+    out.append(value.toUtf8().replace('"', "\"\""));
+    out.append('"');
+}
+
+static void appendJSONString(QByteArray & out, const QByteArray & value) {
+    static const char hex[] = "0123456789abcdef";
+
+    out.append('"');
+    for (int i = 0; i < value.size(); i++) {
+        const char c = value.at(i);
+        switch (c) {
+        case '"':  out.append("\\\""); break;
+        case '\\': out.append("\\\\"); break;
+        case '\n': out.append("\\n");  break;
+        case '\r': out.append("\\r");  break;
+        case '\t': out.append("\\t");  break;
+        default:
+            if ((uchar) c < 0x20) {
+                out.append("\\u00");
+                out.append(hex[(uchar) c >> 4]);
+                out.append(hex[(uchar) c & 0xf]);
+            }
+            else
+                out.append(c);
+        }
+    }
+    out.append('"');
+}
+
+
+//------------------------------------------------------------------------------
+// ClassifierWriter.
+
+ClassifierWriter::ClassifierWriter(QIODevice * output, QSemaphore * freeSlots) {
+    this->output = output;
+    this->freeSlots = freeSlots;
+    this->nextSequence = 0;
+    this->numChunks = 0;
+    this->finished = false;
+    this->failed = false;
+}
+
+void ClassifierWriter::submit(quint64 sequence, const QByteArray & data) {
+    QMutexLocker locker(&this->mutex);
+    this->pending.insert(sequence, data);
+    this->submitted.wakeOne();
+}
+
+/**
+ * Let the writer know how many chunks there are in total, so it can stop
+ * once it has written all of them.
+ */
+void ClassifierWriter::finish(quint64 numChunks) {
+    QMutexLocker locker(&this->mutex);
+    this->numChunks = numChunks;
+    this->finished = true;
+    this->submitted.wakeOne();
+}
+
+void ClassifierWriter::run() {
+    QByteArray data;
+
+    forever {
+        this->mutex.lock();
+        while (!this->pending.contains(this->nextSequence) && !(this->finished && this->nextSequence == this->numChunks))
+            this->submitted.wait(&this->mutex);
+        if (this->finished && this->nextSequence == this->numChunks) {
+            this->mutex.unlock();
+            break;
+        }
+        data = this->pending.take(this->nextSequence);
+        this->nextSequence++;
+        this->mutex.unlock();
+
+        if (!this->failed && this->output->write(data) != data.size()) {
+            qCritical("Could not write the output: %s.", qPrintable(this->output->errorString()));
+            this->failed = true;
+        }
+
+        // The chunk has left the pipeline: allow the reader to read another.
+        this->freeSlots->release();
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// ClassifierTask.
+
+ClassifierTask::ClassifierTask(QBrowsCap * browsCap, const ClassifierOptions & options,
+                               ClassifierWriter * writer, quint64 sequence,
+                               const QByteArray & chunk)
+{
+    this->browsCap = browsCap;
+    this->options  = options;
+    this->writer   = writer;
+    this->sequence = sequence;
+    this->chunk    = chunk;
+
+    if (!options.regExp.isEmpty())
+        this->regExp = QRegExp(options.regExp);
+}
+
+void ClassifierTask::run() {
+    // Most log lines share a handful of user agents: remember the matches
+    // within this chunk to avoid contending for QBrowsCap's cache mutex.
+    QHash<QString, QPair<bool, QBrowsCapRecord> > matches;
+    QPair<bool, QBrowsCapRecord> match;
+    QString userAgent;
+    QByteArray out;
+    QByteArray line;
+    int start = 0, end, length;
+
+    out.reserve(this->chunk.size() * 2);
+
+    while (start < this->chunk.size()) {
+        end = this->chunk.indexOf('\n', start);
+        if (end == -1)
+            end = this->chunk.size();
+        length = end - start;
+        if (length > 0 && this->chunk.at(end - 1) == '\r')
+            length--;
+        line = QByteArray::fromRawData(this->chunk.constData() + start, length);
+        start = end + 1;
+
+        userAgent = this->extractUserAgent(line);
+        if (!matches.contains(userAgent)) {
+            match = this->browsCap->matchUserAgent(userAgent);
+            matches.insert(userAgent, match);
+        }
+        else
+            match = matches.value(userAgent);
+
+        if (this->options.format == ClassifierOptions::JSON)
+            this->appendJSON(out, line, match);
+        else
+            this->appendCSV(out, line, match);
+    }
+
+    this->writer->submit(this->sequence, out);
+}
+
+QString ClassifierTask::extractUserAgent(const QByteArray & line) {
+    if (!this->regExp.isEmpty()) {
+        if (this->regExp.indexIn(QString::fromUtf8(line.constData(), line.size())) == -1)
+            return QString();
+        return this->regExp.cap(1);
+    }
+    else if (this->options.column > 0) {
+        int start = 0, end;
+        for (int column = 1; column < this->options.column; column++) {
+            start = line.indexOf(this->options.delimiter, start);
+            if (start == -1)
+                return QString();
+            start++;
+        }
+        end = line.indexOf(this->options.delimiter, start);
+        if (end == -1)
+            end = line.size();
+        return QString::fromUtf8(line.constData() + start, end - start);
+    }
+    else
+        return QString::fromUtf8(line.constData(), line.size());
+}
+
+/**
+ * Append the match as extra columns to the line. The columns are separated by
+ * the same delimiter as the line's own columns, so the output has the same
+ * format as the input (e.g. CSV or TSV).
+ */
+void ClassifierTask::appendCSV(QByteArray & out, const QByteArray & line, const QPair<bool, QBrowsCapRecord> & match) const {
+    const char delimiter = this->options.delimiter;
+
+    out.append(line);
+    out.append(delimiter);
+    if (match.first) {
+        appendQuoted(out, match.second.browser_name);
+        out.append(delimiter);
+        appendQuoted(out, match.second.browser_version);
+        out.append(delimiter);
+        appendQuoted(out, match.second.platform);
+        out.append(delimiter);
+        out.append(match.second.is_mobile ? '1' : '0');
+    }
+    else
+        out.append(QByteArray(3, delimiter));
+    out.append('\n');
+}
+
+void ClassifierTask::appendJSON(QByteArray & out, const QByteArray & line, const QPair<bool, QBrowsCapRecord> & match) const {
+    out.append("{\"line\":");
+    appendJSONString(out, line);
+    if (match.first) {
+        out.append(",\"browser\":");
+        appendJSONString(out, match.second.browser_name.toUtf8());
+        out.append(",\"version\":");
+        appendJSONString(out, match.second.browser_version.toUtf8());
+        out.append(",\"platform\":");
+        appendJSONString(out, match.second.platform.toUtf8());
+        out.append(match.second.is_mobile ? ",\"is_mobile\":true}\n" : ",\"is_mobile\":false}\n");
+    }
+    else
+        out.append(",\"browser\":null,\"version\":null,\"platform\":null,\"is_mobile\":null}\n");
+}
+
+
+//------------------------------------------------------------------------------
+// Classifier.
+
+Classifier::Classifier(QBrowsCap * browsCap, const ClassifierOptions & options) {
+    this->browsCap = browsCap;
+    this->options  = options;
+    this->numLines = 0;
+    this->numBytes = 0;
+}
+
+/**
+ * Classify all lines of all inputs and write them to the output, in order.
+ *
+ * The calling thread reads the inputs in large chunks (cut at line
+ * boundaries), the matcher pool classifies the chunks and the writer writes
+ * them. The number of chunks in the pipeline is bounded, so memory usage is
+ * independent of the size of the inputs.
+ */
+bool Classifier::classify(const QList<QIODevice *> & inputs, QIODevice * output) {
+    const int numThreads = qMax(1, this->options.threads);
+    QSemaphore freeSlots(numThreads * 2);
+    QThreadPool pool;
+    ClassifierWriter writer(output, &freeSlots);
+    quint64 sequence = 0;
+    QByteArray chunk, remainder;
+    int cut;
+
+    pool.setMaxThreadCount(numThreads);
+    writer.start();
+
+    foreach (QIODevice * input, inputs) {
+        forever {
+            // An empty read means the end of the input has been reached.
+            const QByteArray data = input->read(CLASSIFIER_CHUNK_SIZE);
+            const bool atEnd = data.isEmpty();
+            chunk = remainder + data;
+            remainder.clear();
+
+            if (!atEnd) {
+                // Keep the incomplete last line for the next chunk.
+                cut = chunk.lastIndexOf('\n');
+                if (cut == -1) {
+                    remainder = chunk;
+                    continue;
+                }
+                remainder = chunk.mid(cut + 1);
+                chunk.truncate(cut + 1);
+            }
+
+            if (!chunk.isEmpty()) {
+                this->numBytes += chunk.size();
+                this->numLines += chunk.count('\n') + (chunk.endsWith('\n') ? 0 : 1);
+
+                freeSlots.acquire();
+                pool.start(new ClassifierTask(this->browsCap, this->options, &writer, sequence++, chunk));
+            }
+
+            if (atEnd)
+                break;
+        }
+    }
+
+    pool.waitForDone();
+    writer.finish(sequence);
+    writer.wait();
+
+    return !writer.hasFailed();
+}
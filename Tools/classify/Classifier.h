@@ -0,0 +1,111 @@
+#ifndef CLASSIFIER_H
+#define CLASSIFIER_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QIODevice>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QRegExp>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThread>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include "QBrowsCap.h"
+
+
+#define CLASSIFIER_CHUNK_SIZE 1048576 // Read the input in chunks of 1 MB.
+
+
+struct ClassifierOptions {
+    enum Format { CSV, JSON };
+
+    ClassifierOptions() : column(0), delimiter('\t'), format(CSV), threads(QThread::idealThreadCount()) {}
+
+    // The user agent is either in a column (1-based, 0 means the whole line)
+    // or in the first capture group of a regular expression.
+    int column;
+    char delimiter;
+    QString regExp;
+
+    Format format;
+    int threads;
+};
+
+
+/**
+ * Writes classified chunks to the output in the order in which they were
+ * read, even though the matcher pool may finish them in any order.
+ */
+class ClassifierWriter : public QThread {
+public:
+    ClassifierWriter(QIODevice * output, QSemaphore * freeSlots);
+
+    void submit(quint64 sequence, const QByteArray & data);
+    void finish(quint64 numChunks);
+    bool hasFailed() const { return this->failed; }
+
+protected:
+    void run();
+
+    QIODevice * output;
+    QSemaphore * freeSlots;
+
+    QMutex mutex;
+    QWaitCondition submitted;
+    QMap<quint64, QByteArray> pending;
+    quint64 nextSequence;
+    quint64 numChunks;
+    bool finished;
+    bool failed;
+};
+
+
+/**
+ * Classifies all lines in a single chunk of the input.
+ */
+class ClassifierTask : public QRunnable {
+public:
+    ClassifierTask(QBrowsCap * browsCap, const ClassifierOptions & options,
+                   ClassifierWriter * writer, quint64 sequence,
+                   const QByteArray & chunk);
+
+    void run();
+
+protected:
+    QString extractUserAgent(const QByteArray & line);
+    void appendCSV(QByteArray & out, const QByteArray & line, const QPair<bool, QBrowsCapRecord> & match) const;
+    void appendJSON(QByteArray & out, const QByteArray & line, const QPair<bool, QBrowsCapRecord> & match) const;
+
+    QBrowsCap * browsCap;
+    ClassifierOptions options;
+    QRegExp regExp;
+    ClassifierWriter * writer;
+    quint64 sequence;
+    QByteArray chunk;
+};
+
+
+/**
+ * A pipeline of a reader (the calling thread), a pool of matchers and an
+ * ordered writer.
+ */
+class Classifier {
+public:
+    Classifier(QBrowsCap * browsCap, const ClassifierOptions & options);
+
+    bool classify(const QList<QIODevice *> & inputs, QIODevice * output);
+
+    quint64 getNumLines() const { return this->numLines; }
+    quint64 getNumBytes() const { return this->numBytes; }
+
+protected:
+    QBrowsCap * browsCap;
+    ClassifierOptions options;
+    quint64 numLines;
+    quint64 numBytes;
+};
+
+#endif // CLASSIFIER_H
@@ -0,0 +1,14 @@
+DEPENDPATH += ../..
+INCLUDEPATH += ../..
+include("../../QBrowsCap.pri")
+
+TARGET = classify
+
+HEADERS += Classifier.h
+SOURCES += Classifier.cpp \
+           main.cpp
+
+CONFIG += console
+macx {
+  CONFIG -= app_bundle
+}
@@ -0,0 +1,133 @@
+#include "QBrowsCap.h"
+#include "Classifier.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QStringList>
+
+static void usage(QTextStream & cerr) {
+    cerr << "Usage: classify [options] [file ...]" << endl
+         << endl
+         << "Appends the browser, version, platform and is_mobile of the user agent" << endl
+         << "in each line of the given log files (or stdin) and writes the result" << endl
+         << "to stdout. In csv format, they are appended as extra columns, separated" << endl
+         << "by the column delimiter." << endl
+         << endl
+         << "Options:" << endl
+         << "  --csv <file>         The browscap.csv file (default: ./browscap.csv)." << endl
+         << "  --index <file>       The index file (default: ./index.db)." << endl
+         << "  --column <n>         The user agent is in column n (1-based)." << endl
+         << "  --delimiter <c>      The column delimiter (default: tab)." << endl
+         << "  --regexp <pattern>   The user agent is the first capture group of" << endl
+         << "                       pattern, e.g. '\"([^\"]*)\"$' for combined logs." << endl
+         << "  --format <csv|json>  The output format (default: csv)." << endl
+         << "  --threads <n>        The number of matcher threads." << endl;
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QTextStream cerr(stderr);
+    QStringList args = app.arguments();
+    QString csvFile = "./browscap.csv";
+    QString indexFile = "./index.db";
+    ClassifierOptions options;
+    QStringList files;
+    QString arg;
+    bool ok = true;
+
+    args.removeFirst();
+    while (!args.isEmpty()) {
+        arg = args.takeFirst();
+        if (arg == "-h" || arg == "--help") {
+            usage(cerr);
+            return 0;
+        }
+        else if (!arg.startsWith("--") || arg == "-") {
+            files << arg;
+            continue;
+        }
+        else if (args.isEmpty()) {
+            cerr << QString("Missing value for %1.").arg(arg) << endl;
+            return 1;
+        }
+
+        if (arg == "--csv")
+            csvFile = args.takeFirst();
+        else if (arg == "--index")
+            indexFile = args.takeFirst();
+        else if (arg == "--column")
+            options.column = args.takeFirst().toInt(&ok);
+        else if (arg == "--delimiter") {
+            QString delimiter = args.takeFirst().replace("\\t", "\t");
+            ok = delimiter.length() == 1;
+            if (ok)
+                options.delimiter = delimiter.at(0).toLatin1();
+        }
+        else if (arg == "--regexp") {
+            options.regExp = args.takeFirst();
+            ok = QRegExp(options.regExp).isValid();
+        }
+        else if (arg == "--format") {
+            QString format = args.takeFirst();
+            ok = (format == "csv" || format == "json");
+            options.format = (format == "json") ? ClassifierOptions::JSON : ClassifierOptions::CSV;
+        }
+        else if (arg == "--threads")
+            options.threads = args.takeFirst().toInt(&ok);
+        else {
+            usage(cerr);
+            return 1;
+        }
+
+        if (!ok) {
+            cerr << QString("Invalid value for %1.").arg(arg) << endl;
+            return 1;
+        }
+    }
+    if (files.isEmpty())
+        files << "-";
+
+    QBrowsCap browsCap;
+    browsCap.setCsvFile(csvFile);
+    browsCap.setIndexFile(indexFile);
+    if (!browsCap.buildIndex()) {
+        cerr << "The index could not be built." << endl;
+        return 1;
+    }
+
+    QList<QIODevice *> inputs;
+    foreach (const QString & fileName, files) {
+        QFile * file = new QFile(fileName);
+        if (fileName == "-")
+            ok = file->open(stdin, QIODevice::ReadOnly);
+        else
+            ok = file->open(QIODevice::ReadOnly);
+        if (!ok) {
+            cerr << QString("Could not open '%1' for reading: %2.").arg(fileName, file->errorString()) << endl;
+            return 1;
+        }
+        inputs << file;
+    }
+
+    QFile output;
+    output.open(stdout, QIODevice::WriteOnly);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    Classifier classifier(&browsCap, options);
+    ok = classifier.classify(inputs, &output);
+    output.flush();
+
+    qint64 timePassed = qMax(timer.elapsed(), (qint64) 1);
+    cerr << QString("Classified %1 lines (%2 MB) in %3 ms: %4 lines/s, %5 MB/s.")
+            .arg(classifier.getNumLines())
+            .arg(classifier.getNumBytes() / 1048576)
+            .arg(timePassed)
+            .arg(classifier.getNumLines() * 1000 / timePassed)
+            .arg(classifier.getNumBytes() * 1000 / 1048576 / timePassed)
+         << endl;
+
+    qDeleteAll(inputs);
+
+    return ok ? 0 : 1;
+}
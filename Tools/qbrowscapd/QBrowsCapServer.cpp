@@ -0,0 +1,204 @@
+#include "QBrowsCapServer.h"
+
+QBrowsCapServer::QBrowsCapServer(QBrowsCap * browsCap) {
+    this->browsCap = browsCap;
+    this->nextConnectionId = 0;
+    this->updatePool.setMaxThreadCount(1);
+
+    connect(&this->server, SIGNAL(newConnection()), SLOT(acceptConnections()));
+    connect(&this->updateTimer, SIGNAL(timeout()), SLOT(selfUpdate()));
+}
+
+QBrowsCapServer::~QBrowsCapServer() {
+    this->lookupPool.waitForDone();
+    this->updatePool.waitForDone();
+}
+
+bool QBrowsCapServer::listen(const QString & serverName) {
+    // Remove the socket of a previous instance that didn't shut down cleanly,
+    // but never take it away from an instance that is still running.
+    QLocalSocket probe;
+    probe.connectToServer(serverName);
+    if (probe.waitForConnected(QBROWSCAPD_PROBE_TIMEOUT)) {
+        qCritical("Another instance is already listening on '%s'.", qPrintable(serverName));
+        return false;
+    }
+    QLocalServer::removeServer(serverName);
+
+    if (!this->server.listen(serverName)) {
+        qCritical("Could not listen on '%s': %s.", qPrintable(serverName), qPrintable(this->server.errorString()));
+        return false;
+    }
+
+    this->updateTimer.start(QBROWSCAPD_UPDATE_INTERVAL);
+
+    return true;
+}
+
+void QBrowsCapServer::acceptConnections() {
+    QLocalSocket * socket;
+
+    while ((socket = this->server.nextPendingConnection()) != NULL) {
+        const uint connectionId = this->nextConnectionId++;
+        this->connections[connectionId].socket = socket;
+        this->connectionIds.insert(socket, connectionId);
+        connect(socket, SIGNAL(readyRead()), SLOT(readRequests()));
+        connect(socket, SIGNAL(disconnected()), SLOT(dropConnection()));
+    }
+}
+
+/**
+ * Hand all complete requests that have been received on a connection to the
+ * lookup pool, as one batch, so that their responses cost a single write.
+ */
+void QBrowsCapServer::readRequests() {
+    QLocalSocket * socket = qobject_cast<QLocalSocket *>(this->sender());
+    if (socket == NULL || !this->connectionIds.contains(socket))
+        return;
+
+    const uint connectionId = this->connectionIds.value(socket);
+    QBrowsCapServerConnection & connection = this->connections[connectionId];
+    QList<QByteArray> payloads;
+    QByteArray payload;
+    bool ok;
+
+    connection.buffer.append(socket->readAll());
+    while (QBrowsCapClient::takeFrame(connection.buffer, payload, &ok))
+        payloads << payload;
+
+    if (!ok) {
+        qWarning("Received an invalid frame, dropping the connection.");
+        this->closeConnection(connectionId);
+        return;
+    }
+
+    if (!payloads.isEmpty())
+        this->lookupPool.start(new QBrowsCapRequestTask(this, connectionId, connection.nextBatch++, payloads));
+}
+
+void QBrowsCapServer::dropConnection() {
+    QLocalSocket * socket = qobject_cast<QLocalSocket *>(this->sender());
+    if (socket == NULL || !this->connectionIds.contains(socket))
+        return; // Already closed by closeConnection().
+
+    this->connections.remove(this->connectionIds.take(socket));
+    socket->deleteLater();
+}
+
+/**
+ * Write the responses to a batch of requests, once those to all earlier
+ * batches of the connection have been written. Called on the event loop's
+ * thread by QBrowsCapRequestTask.
+ */
+void QBrowsCapServer::sendResponses(uint connectionId, uint batch, const QByteArray & responses, bool ok) {
+    if (!this->connections.contains(connectionId))
+        return; // The client has disconnected in the meantime.
+
+    QBrowsCapServerConnection & connection = this->connections[connectionId];
+    connection.responses.insert(batch, qMakePair(responses, ok));
+
+    QPair<QByteArray, bool> response;
+    while (connection.responses.contains(connection.nextResponse)) {
+        response = connection.responses.take(connection.nextResponse++);
+        if (!response.first.isEmpty())
+            connection.socket->write(response.first);
+
+        if (!response.second) {
+            qWarning("Received an invalid request, dropping the connection.");
+            this->closeConnection(connectionId);
+            return;
+        }
+    }
+}
+
+void QBrowsCapServer::closeConnection(uint connectionId) {
+    QLocalSocket * socket = this->connections.take(connectionId).socket;
+    if (socket == NULL)
+        return;
+
+    this->connectionIds.remove(socket);
+    socket->disconnectFromServer();
+    socket->deleteLater();
+}
+
+/**
+ * Centralized self-updating: clients never have to check for updates. The
+ * update runs on its own thread, while lookups continue with the current
+ * index; they switch to the rebuilt index once it is ready.
+ */
+void QBrowsCapServer::selfUpdate() {
+    if (this->updating.testAndSetOrdered(0, 1))
+        this->updatePool.start(new QBrowsCapUpdateTask(this));
+}
+
+/**
+ * Answer a single request. Safe to call from any thread.
+ */
+QByteArray QBrowsCapServer::handleRequest(const QByteArray & payload, bool * ok) {
+    QList<QPair<bool, QBrowsCapRecord> > answers;
+    QStringList userAgents;
+    quint32 requestId;
+
+    *ok = QBrowsCapClient::decodeRequest(payload, requestId, userAgents);
+    if (!*ok)
+        return QByteArray();
+
+    foreach (const QString & userAgent, userAgents)
+        answers << this->browsCap->matchUserAgent(userAgent);
+
+    QByteArray response;
+    QDataStream out(&response, QIODevice::WriteOnly);
+    out.setVersion(QBROWSCAP_PROTOCOL_DATASTREAM_VERSION);
+    out << requestId << answers;
+
+    return response;
+}
+
+
+//------------------------------------------------------------------------------
+// QBrowsCapRequestTask.
+
+QBrowsCapRequestTask::QBrowsCapRequestTask(QBrowsCapServer * server, uint connectionId, uint batch, const QList<QByteArray> & payloads) {
+    this->server = server;
+    this->connectionId = connectionId;
+    this->batch = batch;
+    this->payloads = payloads;
+}
+
+void QBrowsCapRequestTask::run() {
+    QByteArray responses;
+    bool ok = true;
+
+    foreach (const QByteArray & payload, this->payloads) {
+        const QByteArray response = this->server->handleRequest(payload, &ok);
+        if (!ok)
+            break;
+        responses.append(QBrowsCapClient::frame(response));
+    }
+
+    // Sockets may only be used from the thread that owns them.
+    QMetaObject::invokeMethod(this->server, "sendResponses", Qt::QueuedConnection,
+                              Q_ARG(uint, this->connectionId),
+                              Q_ARG(uint, this->batch),
+                              Q_ARG(QByteArray, responses),
+                              Q_ARG(bool, ok));
+}
+
+
+//------------------------------------------------------------------------------
+// QBrowsCapUpdateTask.
+
+QBrowsCapUpdateTask::QBrowsCapUpdateTask(QBrowsCapServer * server) {
+    this->server = server;
+}
+
+void QBrowsCapUpdateTask::run() {
+    // QBrowsCap downloads updates with a QNetworkAccessManager, which may only
+    // be used from the thread that created it, so use a separate instance.
+    // The rebuilt index is picked up by the server's instance, since both use
+    // the same index file.
+    QBrowsCap updater(this->server->browsCap->getCsvFile(), this->server->browsCap->getIndexFile());
+    updater.selfUpdate();
+
+    this->server->updating.fetchAndStoreOrdered(0);
+}
@@ -0,0 +1,109 @@
+#ifndef QBROWSCAPSERVER_H
+#define QBROWSCAPSERVER_H
+
+#include <QObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QHash>
+#include <QMap>
+#include <QPair>
+#include <QList>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QAtomicInt>
+#include <QTimer>
+#include "QBrowsCap.h"
+#include "QBrowsCapClient.h"
+
+
+#define QBROWSCAPD_UPDATE_INTERVAL 3600000 // Try to self-update every hour.
+#define QBROWSCAPD_PROBE_TIMEOUT 1000
+
+
+class QBrowsCapServer;
+
+// The state of a client connection. Batches of requests are numbered in the
+// order in which they were received; their responses may be ready in any
+// order, but are written in that same order.
+struct QBrowsCapServerConnection {
+    QBrowsCapServerConnection() : socket(NULL), nextBatch(0), nextResponse(0) {}
+
+    QLocalSocket * socket;
+    QByteArray buffer;
+    uint nextBatch;
+    uint nextResponse;
+    QMap<uint, QPair<QByteArray, bool> > responses;
+};
+
+/**
+ * Answers a batch of requests of one connection on a worker thread.
+ */
+class QBrowsCapRequestTask : public QRunnable {
+public:
+    QBrowsCapRequestTask(QBrowsCapServer * server, uint connectionId, uint batch, const QList<QByteArray> & payloads);
+    void run();
+
+protected:
+    QBrowsCapServer * server;
+    uint connectionId;
+    uint batch;
+    QList<QByteArray> payloads;
+};
+
+/**
+ * Updates the browscap.csv file and rebuilds the index on a worker thread.
+ */
+class QBrowsCapUpdateTask : public QRunnable {
+public:
+    QBrowsCapUpdateTask(QBrowsCapServer * server);
+    void run();
+
+protected:
+    QBrowsCapServer * server;
+};
+
+
+/**
+ * Serves QBrowsCapClient lookups from a single QBrowsCap instance, so that
+ * all clients share one index, one cache and one update check. The event
+ * loop only reads and writes sockets: lookups and updates run on worker
+ * threads, so that neither a slow lookup nor a rebuild of the index holds up
+ * the other clients.
+ */
+class QBrowsCapServer : public QObject {
+    Q_OBJECT
+
+    friend class QBrowsCapRequestTask;
+    friend class QBrowsCapUpdateTask;
+
+public:
+    QBrowsCapServer(QBrowsCap * browsCap);
+    ~QBrowsCapServer();
+
+    bool listen(const QString & serverName = QBROWSCAP_DEFAULT_SERVER_NAME);
+
+protected slots:
+    void acceptConnections();
+    void readRequests();
+    void dropConnection();
+    void selfUpdate();
+    void sendResponses(uint connectionId, uint batch, const QByteArray & responses, bool ok);
+
+protected:
+    QBrowsCap * browsCap;
+    QLocalServer server;
+    QTimer updateTimer;
+
+    QHash<uint, QBrowsCapServerConnection> connections;
+    QHash<QLocalSocket *, uint> connectionIds;
+    uint nextConnectionId;
+
+    QThreadPool lookupPool;
+    QThreadPool updatePool;
+    QAtomicInt updating;
+
+    QByteArray handleRequest(const QByteArray & payload, bool * ok);
+    void closeConnection(uint connectionId);
+};
+
+#endif // QBROWSCAPSERVER_H
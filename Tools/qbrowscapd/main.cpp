@@ -0,0 +1,44 @@
+#include "QBrowsCap.h"
+#include "QBrowsCapServer.h"
+#include <QCoreApplication>
+#include <QStringList>
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QTextStream cerr(stderr);
+    QStringList args = app.arguments();
+    QString csvFile = "./browscap.csv";
+    QString indexFile = "./index.db";
+    QString serverName = QBROWSCAP_DEFAULT_SERVER_NAME;
+    QString arg;
+
+    args.removeFirst();
+    while (!args.isEmpty()) {
+        arg = args.takeFirst();
+        if (args.isEmpty() || !(arg == "--csv" || arg == "--index" || arg == "--socket")) {
+            cerr << "Usage: qbrowscapd [--csv <file>] [--index <file>] [--socket <name>]" << endl;
+            return 1;
+        }
+        else if (arg == "--csv")
+            csvFile = args.takeFirst();
+        else if (arg == "--index")
+            indexFile = args.takeFirst();
+        else if (arg == "--socket")
+            serverName = args.takeFirst();
+    }
+
+    QBrowsCap browsCap;
+    browsCap.setCsvFile(csvFile);
+    browsCap.setIndexFile(indexFile);
+    browsCap.selfUpdate();
+    if (!browsCap.buildIndex()) {
+        cerr << "The index could not be built." << endl;
+        return 1;
+    }
+
+    QBrowsCapServer server(&browsCap);
+    if (!server.listen(serverName))
+        return 1;
+
+    return app.exec();
+}
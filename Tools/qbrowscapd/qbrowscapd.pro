@@ -0,0 +1,14 @@
+DEPENDPATH += ../..
+INCLUDEPATH += ../..
+include("../../QBrowsCap.pri")
+
+TARGET = qbrowscapd
+
+HEADERS += QBrowsCapServer.h
+SOURCES += QBrowsCapServer.cpp \
+           main.cpp
+
+CONFIG += console
+macx {
+  CONFIG -= app_bundle
+}